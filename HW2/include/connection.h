@@ -0,0 +1,69 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <string>
+
+/**
+ * @brief The Connection class, a buffered client connection
+ *
+ * Reads are done in large chunks and split into lines, so that commands a
+ * client pipelines (RFC 2920) are all picked up from one read(). Replies are
+ * queued and only written out when the input buffer runs dry (or on Flush),
+ * which coalesces the replies to a batch of pipelined commands into a single
+ * write(). A line is never buffered beyond max_line(), so a client sending
+ * data without line breaks can't make the buffer grow without limit.
+ */
+class Connection {
+public:
+  Connection(int fd, bool verbose);
+
+  // Disable copy constructor and copy-assignment operator
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
+  int fd() const { return fd_; }
+
+  /// Longest line accepted by ReadLine, counting its CRLF
+  size_t max_line() const { return max_line_; }
+  void set_max_line(size_t max_line) { max_line_ = max_line; }
+
+  /// Set when ReadLine failed because the line is longer than max_line()
+  bool line_too_long() const { return line_too_long_; }
+
+  /**
+   * @brief Read one line without the trailing CRLF
+   * @param line, output line
+   * @return False if read failed, client closed connection or the line is
+   * too long. Nothing more can be read after a line that is too long
+   */
+  bool ReadLine(std::string &line);
+
+  /**
+   * @brief Queue one line, CRLF is appended
+   */
+  void WriteLine(const std::string &line);
+
+  /**
+   * @brief Write all queued lines to the socket
+   * @return False if write failed
+   */
+  bool Flush();
+
+  /**
+   * @brief Check if there is a complete line already buffered
+   */
+  bool HasBufferedLine() const;
+
+private:
+  bool Fill();
+
+  int fd_;
+  bool verbose_;
+  size_t max_line_ = 1000; // RFC 5321 limit for a line of mail text
+  bool line_too_long_ = false;
+  std::string rbuf_; // data read but not consumed yet
+  size_t rpos_ = 0;  // start of unconsumed data in rbuf_
+  std::string wbuf_; // replies not written yet
+};
+
+#endif // CONNECTION_H
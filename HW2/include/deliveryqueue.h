@@ -0,0 +1,107 @@
+#ifndef DELIVERYQUEUE_H
+#define DELIVERYQUEUE_H
+
+#include "mail.h"
+#include "spool.h"
+#include "threadpool.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief The DeliveryQueue class, mails accepted by SMTP but not yet in the
+ * recipients' mailboxes
+ *
+ * A mail is queued as two files in the queue dir, "<id>.msg" with the content
+ * and "<id>.env" with sender, time and the recipients still to deliver to.
+ * Both are synced before Enqueue returns, so a mail is never lost once it has
+ * been acknowledged. A background thread takes all mails that are due,
+ * delivers them to every recipient on the delivery pool and removes them.
+ * Recipients that failed are written back to the envelope and retried later
+ * with a growing delay. After too many attempts, a mail is moved to the
+ * "failed" dir inside the queue dir, its envelope lists the recipients it
+ * never reached. Mails left in the queue dir are picked up again at Start().
+ * A crash right after a delivery may deliver that mail twice, but never drops
+ * it.
+ */
+class DeliveryQueue {
+public:
+  using DeliverFn = std::function<bool(const Mail &mail, const Spool &spool,
+                                       const std::string &recipient)>;
+
+  DeliveryQueue(const std::string &dir, ThreadPool &pool, DeliverFn deliver);
+  ~DeliveryQueue();
+
+  // Disable copy constructor and copy-assignment operator
+  DeliveryQueue(const DeliveryQueue &) = delete;
+  DeliveryQueue &operator=(const DeliveryQueue &) = delete;
+
+  const std::string &dir() const { return dir_; }
+
+  /**
+   * @brief Create the queue dir, queue the mails left from last run and start
+   * the delivery thread
+   */
+  void Start();
+
+  /**
+   * @brief Move a finished spool into the queue, durably. The spool is
+   * committed and can be cleared for the next mail
+   * @return False if the mail could not be queued, it is not accepted then
+   */
+  bool Enqueue(const Mail &mail, Spool &spool);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Item {
+    std::string id;
+    Mail mail; // recipients still to deliver to
+    Spool spool;
+    int attempts = 0;
+    Clock::time_point due;
+
+    Item(const std::string &id, const std::string &dir) : id(id), spool(dir) {}
+  };
+  using ItemPtr = std::shared_ptr<Item>;
+
+  void Run();
+
+  /**
+   * @brief Deliver a batch of mails, each recipient is one task on the pool
+   */
+  void DeliverBatch(const std::vector<ItemPtr> &batch);
+
+  /**
+   * @brief Queue a mail from its files in the queue dir
+   */
+  ItemPtr Load(const std::string &id);
+
+  bool SaveEnvelope(const Item &item) const;
+
+  /**
+   * @brief Move the files of a mail given up on to the failed dir
+   * @return False if they could not be moved, they stay in the queue
+   */
+  bool MoveToFailed(const Item &item) const;
+  void Remove(const Item &item) const;
+  std::string Path(const std::string &id, const char *ext) const;
+
+  std::string dir_;
+  ThreadPool &pool_;
+  DeliverFn deliver_;
+
+  std::vector<ItemPtr> items_; // waiting for delivery or a retry
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+#endif // DELIVERYQUEUE_H
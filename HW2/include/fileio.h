@@ -0,0 +1,129 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <sys/types.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief Write the whole buffer to fd, restart on EINTR and partial writes
+ * @return False if write failed
+ */
+bool WriteAll(int fd, const char *data, size_t len);
+
+/**
+ * @brief Copy len bytes starting at offset of in_fd to the end of out_fd
+ * @return False if read or write failed, or in_fd is too short
+ */
+bool CopyRange(int in_fd, off_t offset, size_t len, int out_fd);
+
+/**
+ * @brief Send len bytes starting at offset of in_fd to out_fd with
+ * sendfile(), so the data never passes through user space. Falls back to
+ * CopyRange if sendfile() is not supported for these fds
+ * @return False if read or write failed, or in_fd is too short
+ */
+bool SendRange(int in_fd, off_t offset, size_t len, int out_fd);
+
+/**
+ * @brief Sync a directory, so renames and removals inside it are durable
+ * @return False if dir could not be opened or synced
+ */
+bool SyncDir(const std::string &dir);
+
+/**
+ * @brief Size of file, 0 if it doesn't exist
+ */
+size_t FileSize(const std::string &path);
+
+/**
+ * @brief The MappedFile class, a whole file mapped read only into memory
+ */
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+
+  // Disable copy constructor and copy-assignment operator
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  /// False if file could not be opened, an empty file is fine
+  bool ok() const { return ok_; }
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  bool ok_ = false;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/**
+ * @brief Check if fd is still the file at path, i.e. it was not replaced
+ * by a rename or removed
+ */
+bool IsSameFile(int fd, const std::string &path);
+
+/**
+ * @brief The FileFd class, an open file descriptor closed on destruction
+ */
+class FileFd {
+public:
+  explicit FileFd(int fd) : fd_(fd) {}
+  ~FileFd();
+
+  // Disable copy constructor and copy-assignment operator
+  FileFd(const FileFd &) = delete;
+  FileFd &operator=(const FileFd &) = delete;
+
+  int fd() const { return fd_; }
+
+private:
+  int fd_;
+};
+
+using FileFdPtr = std::shared_ptr<const FileFd>;
+
+/**
+ * @brief The FdCache class, least recently used mailbox files kept open
+ *
+ * Files are opened read/write with O_APPEND, which serves appends, pread and
+ * sendfile alike. A file evicted while in use stays open until the last user
+ * drops it. Whoever replaces a file by rename has to Evict() its path.
+ */
+class FdCache {
+public:
+  explicit FdCache(size_t capacity) : capacity_(capacity) {}
+
+  /**
+   * @brief Cache shared by all mailboxes, sized against the fd limit
+   */
+  static FdCache &Global();
+
+  /**
+   * @brief Open file, or get it from the cache
+   * @param create Create the file if missing, only for writers
+   * @return nullptr if file could not be opened, or is missing
+   */
+  FileFdPtr Get(const std::string &path, bool create = false);
+
+  /**
+   * @brief Forget path, next Get() opens it again
+   */
+  void Evict(const std::string &path);
+
+private:
+  using Entry = std::pair<std::string, FileFdPtr>;
+
+  size_t capacity_;
+  std::list<Entry> lru_; // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> files_;
+  std::mutex mutex_;
+};
+
+#endif // FILEIO_H
@@ -0,0 +1,63 @@
+#ifndef GROUPCOMMIT_H
+#define GROUPCOMMIT_H
+
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief The GroupCommit class, makes appends to mailbox files durable in
+ * batches
+ *
+ * A writer appends without syncing and then asks for its file to be synced,
+ * waiting on the returned future. Requests are collected for a short window,
+ * or until enough bytes are waiting, and every file in the batch is synced
+ * once with fdatasync(). Writers that appended to the same file while a
+ * batch was being collected share one sync.
+ */
+class GroupCommit {
+public:
+  /**
+   * @param window, how long to wait for more requests after the first one
+   * @param max_bytes, sync right away once this many bytes are waiting
+   */
+  GroupCommit(std::chrono::microseconds window, size_t max_bytes);
+  ~GroupCommit();
+
+  // Disable copy constructor and copy-assignment operator
+  GroupCommit(const GroupCommit &) = delete;
+  GroupCommit &operator=(const GroupCommit &) = delete;
+
+  /**
+   * @brief Ask for a file to be synced with the next batch
+   * @param path, file that was appended to
+   * @param bytes, how much was appended
+   * @return Future that is true once the file is synced
+   */
+  std::future<bool> Sync(const std::string &path, size_t bytes);
+
+private:
+  struct Request {
+    std::string path;
+    std::promise<bool> done;
+  };
+
+  void Run();
+
+  std::chrono::microseconds window_;
+  size_t max_bytes_;
+
+  std::vector<Request> pending_;
+  size_t pending_bytes_ = 0;
+  std::chrono::steady_clock::time_point first_; // first request of batch
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+#endif // GROUPCOMMIT_H
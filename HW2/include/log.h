@@ -0,0 +1,80 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "loguru.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Messages more verbose than LOG_MAX_VERBOSITY are compiled out of LOG_F,
+ * arguments are not even evaluated. Set with make LOG_LEVEL=WARNING etc.
+ */
+#ifndef LOG_MAX_VERBOSITY
+#define LOG_MAX_VERBOSITY loguru::Verbosity_MAX
+#endif
+
+#undef LOG_F
+#define LOG_F(verbosity_name, ...)                                             \
+  ((loguru::Verbosity_##verbosity_name) > (LOG_MAX_VERBOSITY))                 \
+      ? (void)0                                                                \
+      : VLOG_F(loguru::Verbosity_##verbosity_name, __VA_ARGS__)
+
+/**
+ * @brief The AsyncLog class, a loguru sink that writes to a file from a
+ * background thread
+ *
+ * loguru::add_file writes and flushes the file for every message, on the
+ * thread that logs. Here a message is only copied into a ring buffer, and a
+ * writer thread drains the ring to the file every few milliseconds. loguru
+ * calls sinks one message at a time, so there is a single producer and a
+ * single consumer and the ring needs no lock. When the ring is full
+ * messages are dropped and counted rather than blocking the server.
+ */
+class AsyncLog {
+public:
+  /**
+   * @brief Log messages up to verbosity to a file, used instead of
+   * loguru::add_file. What is left is written out at exit
+   * @return False if file could not be opened
+   */
+  static bool AddFile(const std::string &path, loguru::Verbosity verbosity);
+
+  /**
+   * @param file, file to write to, closed with the log
+   */
+  explicit AsyncLog(FILE *file);
+  ~AsyncLog();
+
+  // Disable copy constructor and copy-assignment operator
+  AsyncLog(const AsyncLog &) = delete;
+  AsyncLog &operator=(const AsyncLog &) = delete;
+
+  /**
+   * @brief Queue one message, must not be called from two threads at once
+   */
+  void Push(const loguru::Message &message);
+
+  /**
+   * @brief Wait until everything queued so far is in the file
+   */
+  void Wait() const;
+
+private:
+  void Run();
+  /// Write out ring content, returns false if there was nothing
+  bool Drain();
+
+  FILE *file_;
+  std::vector<char> ring_;
+  std::atomic<size_t> head_{0};    // written by Push
+  std::atomic<size_t> tail_{0};    // written by the writer thread
+  std::atomic<size_t> dropped_{0}; // messages that did not fit
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+
+#endif // LOG_H
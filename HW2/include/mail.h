@@ -1,6 +1,8 @@
 #ifndef MAIL_H
 #define MAIL_H
 
+#include "mailindex.h"
+
 #include <chrono>
 #include <string>
 #include <vector>
@@ -19,21 +21,36 @@ public:
   const std::string &sender() const { return sender_; }
   const std::vector<std::string> &recipients() const { return recipients_; }
   const TimePointSys &time() const { return time_; }
-  const std::vector<std::string> &lines() const { return lines_; }
-  bool deleted() const { return deleted_; }
+  const std::string &body() const { return body_; }
+  const IndexEntry &entry() const { return entry_; }
 
   /// Setters
   void set_sender(const std::string &sender) { sender_ = sender; }
   void set_time(const TimePointSys &time) { time_ = time; }
+  void set_entry(const IndexEntry &entry) { entry_ = entry; }
 
   void SetTimeFromString(const std::string &time_str);
   void AddRecipient(const std::string &recipient) {
     recipients_.push_back(recipient);
   }
-  void AddLine(const std::string &line) { lines_.push_back(line); }
+  void AddLine(const std::string &line) { AddLine(line.data(), line.size()); }
+  void AddLine(const char *data, size_t len);
+
+  /**
+   * @brief Reserve space for content
+   * @param octets, size of the content with CRLF line endings
+   * @param num_lines, number of lines
+   */
+  void Reserve(size_t octets, size_t num_lines);
 
-  void MarkDeleted() const { deleted_ = true; }
-  void MarkUndeleted() const { deleted_ = false; }
+  /// Lines of the content, without CRLF
+  size_t NumLines() const { return line_ends_.size(); }
+  const char *LineData(size_t i) const {
+    return body_.data() + (i == 0 ? 0 : line_ends_[i - 1] + 2);
+  }
+  size_t LineSize(size_t i) const {
+    return line_ends_[i] - (i == 0 ? 0 : line_ends_[i - 1] + 2);
+  }
 
   /**
    * @brief Check if recipient already exists
@@ -63,7 +80,7 @@ public:
   /**
    * @brief Octets of the mail data
    */
-  size_t Octets() const;
+  size_t Octets() const { return body_.size(); }
 
   /**
    * @brief Mail content in one string
@@ -73,9 +90,10 @@ public:
 private:
   std::string sender_;                  // sender's mail address
   std::vector<std::string> recipients_; // recipients' mail address
-  std::vector<std::string> lines_;      // each line of the mail's content
+  std::string body_;                    // content, every line ends in CRLF
+  std::vector<size_t> line_ends_;       // offset of CRLF of each line
   TimePointSys time_;                   // time of recieveing
-  mutable bool deleted_ = false;        // Whether to delete this mail
+  IndexEntry entry_;                    // where it is in the mbox file
 };
 
 #endif // MAIL_H
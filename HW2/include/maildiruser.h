@@ -0,0 +1,53 @@
+#ifndef MAILDIRUSER_H
+#define MAILDIRUSER_H
+
+#include "user.h"
+
+/**
+ * @brief The MaildirUser class, a user whose mailbox is a Maildir
+ *
+ * Each mail is one file. Delivery writes the file to tmp/ and renames it into
+ * new/, so it needs no lock and deliveries to the same user run in parallel.
+ * On login mails in new/ are moved to cur/. The file name carries the size of
+ * the mail (",W=" is the POP3 octet count), so a maildrop is read from the
+ * directory listing alone. Mails are stored with CRLF, so S equals W and
+ * the file can be sent as it is.
+ */
+class MaildirUser : public User {
+public:
+  MaildirUser(const std::string &maildir, const std::string &username);
+
+  /**
+   * @brief Check if dir looks like a Maildir, i.e. has tmp/, new/ and cur/
+   */
+  static bool IsMaildir(const std::string &dir);
+
+  virtual void ClearMailbox() const override;
+  virtual void WriteMail(const Mail &mail) const override;
+  virtual bool WriteMail(const Mail &mail, const Spool &spool) const override;
+  virtual bool Deliver(const Mail &mail, const Spool &spool,
+                       GroupCommit *commit) const override;
+  virtual Maildrop ReadMaildrop() const override;
+  virtual Mail ReadMail(const IndexEntry &entry) const override;
+  virtual Mail ReadTop(const IndexEntry &entry,
+                       size_t num_lines) const override;
+  virtual SendStatus SendMail(const IndexEntry &entry,
+                              int out_fd) const override;
+  virtual bool CommitMaildrop(const Maildrop &maildrop,
+                              bool &compact) const override;
+  virtual void Compact() const override {}
+
+private:
+  /**
+   * @brief Write data to a new file in tmp/ and move it into new/
+   * @param writer, writes the content to the given fd
+   */
+  template <typename Writer>
+  bool WriteFile(size_t octets, Writer writer) const;
+
+  std::string tmp_dir_;
+  std::string new_dir_;
+  std::string cur_dir_;
+};
+
+#endif // MAILDIRUSER_H
@@ -1,33 +1,54 @@
 #ifndef MAILDROP_H
 #define MAILDROP_H
 
-#include "mail.h"
+#include "mailindex.h"
+
+#include <vector>
 
 /**
- * @brief The Maildrop class
+ * @brief The Maildrop class, the mails a POP3 session sees
+ *
+ * Only the index entry of each mail is kept, content is loaded on demand
+ * from the mailbox when a mail is retrieved, so a session costs memory in
+ * the number of mails and not in the size of the mailbox. Totals are kept
+ * up to date as mails are marked, so STAT and LIST do not rescan.
  */
 class Maildrop {
 public:
   Maildrop() = default;
 
-  const std::vector<Mail> &mails() const { return mails_; }
+  const std::vector<IndexEntry> &entries() const { return entries_; }
+
+  void AddEntry(const IndexEntry &entry);
+  void Clear();
 
-  void AddMail(const Mail &mail) { mails_.push_back(mail); }
-  void Clear() { mails_.clear(); }
+  size_t TotalOctets(bool count_deleted = false) const {
+    return count_deleted ? total_octets_ : total_octets_ - deleted_octets_;
+  }
+  size_t NumMails(bool count_deleted = false) const {
+    return count_deleted ? entries_.size() : entries_.size() - num_deleted_;
+  }
 
-  size_t TotalOctets(bool count_deleted = false) const;
-  size_t NumMails(bool count_deleted = false) const;
+  const IndexEntry &GetEntry(size_t i) const { return entries_[i]; }
+  bool IsDeleted(size_t i) const { return deleted_[i]; }
 
-  const Mail &GetMail(size_t i) const { return mails_[i]; }
-  Mail &GetMail(size_t i) { return mails_[i]; }
+  /**
+   * @brief Mark mail i as deleted or undeleted, does nothing if it already is
+   */
+  void MarkDeleted(size_t i);
+  void MarkUndeleted(size_t i);
 
   /**
    * @brief Mark all mails as undeleted
    */
-  void Reset() const; // const because only modify mail delete
+  void Reset();
 
 private:
-  std::vector<Mail> mails_;
+  std::vector<IndexEntry> entries_;
+  std::vector<bool> deleted_; // marked for deletion in this session
+  size_t total_octets_ = 0;   // of all mails
+  size_t deleted_octets_ = 0; // of mails marked for deletion
+  size_t num_deleted_ = 0;
 };
 
 #endif // MAILDROP_H
@@ -0,0 +1,63 @@
+#ifndef MAILINDEX_H
+#define MAILINDEX_H
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief Location and summary of one mail inside an mbox file
+ */
+struct IndexEntry {
+  size_t offset = 0; // start of "From " line
+  size_t body = 0;   // start of mail content
+  size_t end = 0;    // one past the last byte of mail content
+  size_t octets = 0; // size of mail content with CRLF line endings
+  std::string uid;   // unique id
+  bool deleted = false; // deleted, but still in the mbox until compaction
+  bool crlf = false;    // content is stored with CRLF, exactly as POP3 sends it
+  std::string file;     // Maildir only, path of the mail file, not saved
+};
+
+/**
+ * @brief The MailIndex class, the index file of an mbox
+ *
+ * One line per mail: "offset body end octets uid deleted crlf". Deleted
+ * mails are kept in the index as tombstones until the mbox is compacted. The
+ * index is only trusted up to where it ends, mails after that have to be
+ * found by scanning the mbox.
+ */
+class MailIndex {
+public:
+  explicit MailIndex(const std::string &path) : path_(path) {}
+
+  const std::string &path() const { return path_; }
+
+  /**
+   * @brief Check if the index file exists
+   */
+  bool Exists() const;
+
+  /**
+   * @brief Load index
+   * @param entries, output entries
+   * @return False if index is missing or corrupt
+   */
+  bool Load(std::vector<IndexEntry> &entries) const;
+
+  /**
+   * @brief Replace index with entries, atomically and durably, a crash
+   * leaves either the old or the new index
+   * @return False if index could not be written, the old one is left
+   */
+  bool Save(const std::vector<IndexEntry> &entries) const;
+
+  /**
+   * @brief Append one entry
+   */
+  bool Append(const IndexEntry &entry) const;
+
+private:
+  std::string path_;
+};
+
+#endif // MAILINDEX_H
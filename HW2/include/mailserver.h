@@ -4,15 +4,53 @@
 #include "server.h"
 #include "user.h"
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * @brief The UserTable struct, all users of a mailbox dir
+ *
+ * A table is never modified once published, reloading the mailbox dir
+ * builds a new one.
+ */
+struct UserTable {
+  std::vector<UserPtr> users;
+  std::unordered_map<std::string, UserPtr> by_mailaddr;
+  std::unordered_map<std::string, UserPtr> by_username;
+};
+
+using UserTablePtr = std::shared_ptr<const UserTable>;
+
 class MailServer : public Server {
 public:
   MailServer(int port_no, int backlog, bool verbose,
              const std::string &mailbox);
+  virtual ~MailServer();
 
   const std::string &mailbox() const { return mailbox_; }
-  const std::vector<UserPtr> &users() const { return users_; }
+  const std::string &spool_dir() const { return spool_dir_; }
+
+  /**
+   * @brief Current user table, safe to use while the table is reloaded.
+   * Lock free, unless the table was reloaded since this thread last called it
+   */
+  UserTablePtr users() const;
 
+  /**
+   * @brief Scan mailbox dir and publish a new user table. Users that still
+   * exist keep their User object
+   */
   void LoadMailbox();
+
+  /**
+   * @brief Start a thread that reloads users when the mailbox dir changes
+   */
+  void WatchMailbox();
+
   bool UserExistsByMailaddr(const std::string &mail_addr) const;
   bool UserExistsByUsername(const std::string &username) const;
   UserPtr GetUserByMailaddr(const std::string &mail_addr) const;
@@ -20,7 +58,18 @@ public:
 
 protected:
   std::string mailbox_;
-  std::vector<UserPtr> users_;
+  std::string spool_dir_; // temporary files for incoming mail
+
+private:
+  void Watch();
+
+  UserTablePtr users_;                // guarded by users_mutex_
+  mutable std::mutex users_mutex_;
+  std::atomic<uint64_t> users_gen_{0}; // bumped each time users_ changes
+  std::mutex load_mutex_;    // one LoadMailbox at a time
+  int watch_fd_ = -1;        // inotify instance
+  int watch_wd_ = -1;        // watch on mailbox dir
+  std::thread watch_thread_;
 };
 
 #endif // MAILSERVER_H
@@ -7,7 +7,9 @@
 #include <functional>
 #include <regex>
 
-using CmdHandle = std::function<void(int, const Maildrop &, int)>;
+class Connection;
+
+using CmdHandle = std::function<void(Connection &, Maildrop &, int)>;
 
 class Pop3Server : public MailServer {
 public:
@@ -16,26 +18,29 @@ public:
 
   virtual void Work(SocketPtr sock_ptr) override;
 
-  void ReplyOk(int fd, const std::string &msg) const;
-  void ReplyErr(int fd, const std::string &msg) const;
+  void ReplyOk(Connection &conn, const std::string &msg) const;
+  void ReplyErr(Connection &conn, const std::string &msg) const;
 
 private:
   /// Implement each command
-  bool User(int fd, UserPtr &user, const std::string &req) const;
-  void Pass(int fd) const;
-  void Send(int fd, const Mail &mail) const;
-  void Stat(int fd, const Maildrop &md) const;
-  void Rset(int fd, const Maildrop &md) const;
-  void List(int fd, const Maildrop &md, int arg) const;
-  void Uidl(int fd, const Maildrop &md, int arg) const;
-  void Retr(int fd, const Maildrop &md, int arg) const;
-  void Dele(int fd, const Maildrop &md, int arg) const;
+  bool User(Connection &conn, UserPtr &user, const std::string &req) const;
+  void Send(Connection &conn, const Mail &mail) const;
+  void Capa(Connection &conn) const;
+  void Stat(Connection &conn, const Maildrop &md) const;
+  void Rset(Connection &conn, Maildrop &md) const;
+  void List(Connection &conn, const Maildrop &md, int arg) const;
+  void Uidl(Connection &conn, const Maildrop &md, int arg) const;
+  void Retr(Connection &conn, const UserPtr &user, const Maildrop &md,
+            int arg) const;
+  void Top(Connection &conn, const UserPtr &user, const Maildrop &md,
+           const std::string &req) const;
+  void Dele(Connection &conn, Maildrop &md, int arg) const;
 
   /// Wrapper for some of the commands
-  void IntArgCmd(int fd, const Maildrop &md, const std::string &req,
-                 const std::string &cmd, CmdHandle &handle) const;
-  void OptIntArgCmd(int fd, const Maildrop &md, const std::string &req,
-                    const std::string &cmd, CmdHandle &handle) const;
+  void IntArgCmd(Connection &conn, Maildrop &md, const std::string &req,
+                 const char *cmd, CmdHandle &handle) const;
+  void OptIntArgCmd(Connection &conn, Maildrop &md, const std::string &req,
+                    const char *cmd, CmdHandle &handle) const;
 };
 
 #endif // POP3SERVER_H
@@ -1,6 +1,11 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "threadpool.h"
+
+#include <argp.h>
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -9,9 +14,45 @@
 std::string ExtractCommand(const std::string &request, size_t len = 4);
 std::string ExtractArgument(const std::string &request, size_t len = 4);
 
+/**
+ * @brief Pack a command verb into an integer, to match commands with a
+ * switch: case Verb("HELO"). A three letter verb ends with a 0 byte
+ */
+template <size_t N> constexpr uint32_t Verb(const char (&name)[N]) {
+  static_assert(N == 4 || N == 5, "Verbs have three or four letters");
+  uint32_t verb = 0;
+  for (size_t i = 0; i + 1 < N; ++i)
+    verb |= static_cast<uint32_t>(static_cast<unsigned char>(name[i])) << 8 * i;
+  return verb;
+}
+
+/**
+ * @brief Verb of a request in upper case, as packed by Verb(), without
+ * allocating
+ * @return 0 if request does not start with a three or four letter word
+ */
+uint32_t ExtractVerb(const std::string &request);
+
 typedef void (*sa_handler_ptr)(int);
 void SetSigintHandler(sa_handler_ptr handler);
 
+/**
+ * @brief Options every server takes, parsed by server_argp
+ */
+struct ServerOptions {
+  int backlog = 10;  // backlog option to listen
+  int workers = 64;  // worker threads serving connections
+  int pending = 64;  // connections waiting for a worker
+  int acceptors = 1; // threads accepting connections
+};
+
+/**
+ * @brief argp parser of the -b -w -q -n options. Add it as a child of the
+ * program's parser, with child_inputs[0] set to a ServerOptions in
+ * ARGP_KEY_INIT
+ */
+extern const struct argp server_argp;
+
 using SocketPtr = std::shared_ptr<int>;
 
 class Server {
@@ -23,13 +64,28 @@ public:
   Server(const Server &) = delete;
   Server &operator=(const Server &) = delete;
 
+  /**
+   * @brief Accept connections from num_acceptors threads, each with its own
+   * listen socket on the port (SO_REUSEPORT), the kernel spreads new
+   * connections over them. All of them feed the same workers. Call before
+   * Setup
+   */
+  void SetAcceptors(size_t num_acceptors);
+
   /**
    * @brief Setup socket connection
    */
   void Setup();
 
   /**
-   * @brief Run main server loop
+   * @brief Serve connections with a fixed number of worker threads. At most
+   * max_pending accepted connections wait for a free worker, any more are
+   * turned away with OverloadReply(). Call before Run
+   */
+  void SetWorkers(size_t num_workers, size_t max_pending);
+
+  /**
+   * @brief Run main server loop, the calling thread is the first acceptor
    */
   void Run();
 
@@ -48,20 +104,48 @@ public:
   virtual void Stop();
 
 protected:
-  void CreateSocket();
-  void ReuseAddrPort();
-  void BindAddress();
-  void ListenSocket();
+  /**
+   * @brief Reply sent to a connection turned away because the server is
+   * overloaded, before it is closed
+   */
+  virtual std::string OverloadReply() const;
+
+  int CreateSocket();
+  void ReuseAddrPort(int listen_fd);
+  void BindAddress(int listen_fd);
+  void ListenSocket(int listen_fd);
   void Log(const char *format, ...);
   void RemoveClosedSockets();
 
-  int listen_fd_;
+  /**
+   * @brief Close a client socket unless it is closed already, and mark it
+   * as closed
+   */
+  void CloseSocket(const SocketPtr &sock_ptr);
+
   std::mutex sockets_mutex_;
   std::vector<SocketPtr> sockets_;
 
 private:
+  /**
+   * @brief Accept loop of one acceptor
+   */
+  void Accept(size_t index);
+
+  /**
+   * @brief Take a slot for a new connection
+   * @return False if every worker is busy and the queue is full
+   */
+  bool Admit();
+
   int port_no_;
   int backlog_;
+  size_t num_workers_ = 64;
+  size_t max_pending_ = 64;
+  size_t num_acceptors_ = 1;
+  std::vector<int> listen_fds_;         // one per acceptor, by Setup
+  std::unique_ptr<ThreadPool> workers_; // shared by acceptors, by Run
+  std::atomic<size_t> num_admitted_{0}; // connections served or waiting
 
 protected:
   bool verbose_;
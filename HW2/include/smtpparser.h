@@ -0,0 +1,26 @@
+#ifndef SMTPPARSER_H
+#define SMTPPARSER_H
+
+#include <string>
+
+/**
+ * @brief Check if [begin, end) is a mail address "local@domain"
+ *
+ * Local part is a dot-atom (RFC 5321), domain is dot separated labels of
+ * letters, digits and hyphens.
+ */
+bool IsMailaddr(const char *begin, const char *end);
+
+/**
+ * @brief Parse the path argument of MAIL and RCPT in a single pass, e.g.
+ * "MAIL FROM:<some.guy@somewhere>", without building any temporary string
+ * @param request, the command line
+ * @param prefix, "MAIL FROM:" or "RCPT TO:", matched ignoring case
+ * @param mailaddr, output, address between < and >
+ * @param allow_empty, accept the null path "<>"
+ * @return True if request is well formed
+ */
+bool ParsePath(const std::string &request, const char *prefix,
+               std::string &mailaddr, bool allow_empty = false);
+
+#endif // SMTPPARSER_H
@@ -1,9 +1,13 @@
 #ifndef SMTP_SERVER_H
 #define SMTP_SERVER_H
 
+#include "deliveryqueue.h"
+#include "groupcommit.h"
 #include "mailserver.h"
+#include "threadpool.h"
 
-#include <regex>
+class Connection;
+class Spool;
 
 class SmtpServer : public MailServer {
 public:
@@ -12,12 +16,34 @@ public:
 
   virtual void Work(SocketPtr sock_ptr) override;
 
-  void ReplyCode(int fd, int code) const;
-  void SendMail(const Mail &mail, int fd) const;
+  void ReplyCode(Connection &conn, int code) const;
+
+  /**
+   * @brief Start delivering queued mails, including those left from the last
+   * run. Call after LoadMailbox
+   */
+  void StartQueue() { queue_.Start(); }
+
+  /**
+   * @brief Hand spooled mail over to the delivery queue
+   * @return False if mail could not be queued
+   */
+  bool SendMail(const Mail &mail, Spool &spool, int fd);
+
+protected:
+  virtual std::string OverloadReply() const override;
 
 private:
-  std::regex mailfrom_regex_;
-  std::regex rcptto_regex_;
+  /**
+   * @brief Deliver spooled mail to one recipient's mailbox
+   * @return False if delivery failed
+   */
+  bool Deliver(const Mail &mail, const Spool &spool,
+               const std::string &recipient);
+
+  GroupCommit group_commit_; // syncs mailboxes after delivery
+  ThreadPool delivery_pool_; // recipients of queued mails, in parallel
+  DeliveryQueue queue_;
 };
 
 #endif // SMTP_SERVER_H
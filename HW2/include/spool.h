@@ -0,0 +1,111 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include "fileio.h"
+#include "uid.h"
+
+#include <memory>
+#include <string>
+
+/**
+ * @brief The Spool class, mail content of a transaction kept on disk
+ *
+ * Lines are collected in a small fixed size buffer which is written out to
+ * a temporary file in the spool directory whenever it fills up, so memory
+ * stays bounded regardless of the size of the mail. The file is removed
+ * when the spool is destroyed. Content is kept in wire form, every line ends
+ * with CRLF, so it can be stored and later sent by POP3 without conversion.
+ */
+class Spool {
+public:
+  explicit Spool(const std::string &dir);
+  ~Spool();
+
+  // Disable copy constructor and copy-assignment operator
+  Spool(const Spool &) = delete;
+  Spool &operator=(const Spool &) = delete;
+
+  const std::string &path() const { return path_; }
+  int fd() const { return fd_; }
+
+  /// Size in bytes of the spooled content, lines end with CRLF
+  size_t size() const { return size_; }
+  size_t num_lines() const { return num_lines_; }
+
+  /// Size of the content as POP3 counts it, same as size()
+  size_t octets() const { return size_; }
+
+  /// Unique id of the content, valid after Finish()
+  const std::string &uid() const { return uid_; }
+
+  /**
+   * @brief Create the spool file, does nothing if already open
+   * @return False if file could not be created
+   */
+  bool Open();
+
+  /**
+   * @brief Append one line, CRLF is appended
+   * @return False if write failed
+   */
+  bool AddLine(const std::string &line);
+
+  /**
+   * @brief Write out buffered lines and compute unique id, call once all
+   * lines are added and before reading the spool file
+   * @return False if write failed
+   */
+  bool Finish();
+
+  /**
+   * @brief Make the spool file durable and move it to path, call after
+   * Finish(). The file is then no longer part of this spool, the next Open()
+   * creates a new one
+   * @return False if sync or rename failed, the spool is left as it was
+   */
+  bool Commit(const std::string &path);
+
+  /**
+   * @brief Open a committed spool file read only, with what was known about
+   * it when it was committed. The file is not removed with this spool
+   * @return False if file could not be opened or has the wrong size
+   */
+  bool Load(const std::string &path, size_t size, size_t num_lines,
+            const std::string &uid);
+
+  /**
+   * @brief Map the spool file into memory, call after Finish(). CopyTo then
+   * writes every copy from the one mapping, which is worth it when the same
+   * mail goes to many mailboxes
+   * @return False if file could not be mapped, CopyTo still works
+   */
+  bool Map();
+
+  /**
+   * @brief Discard content so the spool can be reused for the next mail
+   */
+  void Clear();
+
+  /**
+   * @brief Copy spooled content to another file descriptor, safe to call
+   * from several threads at once
+   * @return False if read or write failed
+   */
+  bool CopyTo(int out_fd) const;
+
+private:
+  bool Flush();
+
+  std::string dir_;
+  std::string path_;
+  int fd_ = -1;
+  bool owned_ = true; // file is removed in the destructor
+  std::string buffer_; // lines not written to file yet
+  size_t size_ = 0;
+  size_t num_lines_ = 0;
+  UidHasher hasher_;
+  std::string uid_;
+  std::unique_ptr<MappedFile> mapped_; // set by Map()
+};
+
+#endif // SPOOL_H
@@ -0,0 +1,121 @@
+#ifndef TABLEFSM_H
+#define TABLEFSM_H
+
+#include <cstddef>
+
+/**
+ * @brief The TableFsm class, a finite state machine driven by a table built
+ * at compile time
+ *
+ * Transitions are listed in a constexpr array and turned by MakeTable into a
+ * flat array with one entry per (state, trigger), so execute() is a single
+ * lookup. Actions are values of an enum, execute() hands the action of the
+ * transition to a handler, typically a lambda that switches on it, which the
+ * compiler can inline. A machine is only a state and a pointer to the shared
+ * table, creating one per connection allocates nothing.
+ *
+ * As with FSM::Fsm, the first transition listed for a (state, trigger) wins.
+ * There are no guards, decide which trigger to execute instead.
+ *
+ * ~~~
+ * enum class State { Init, Wait };
+ * enum class Trigger { CONN, NOOP };
+ * enum class Action { None, Greet };
+ * using MyFsm = TableFsm<State, State::Init, 2, Trigger, 2, Action>;
+ *
+ * constexpr MyFsm::Trans kTransitions[] = {
+ *     // from, to, trigger, action
+ *     {State::Init, State::Wait, Trigger::CONN, Action::Greet},
+ *     {State::Wait, State::Wait, Trigger::NOOP, Action::None},
+ * };
+ * constexpr auto kTable = MyFsm::MakeTable(kTransitions);
+ *
+ * MyFsm fsm(kTable);
+ * fsm.execute(Trigger::CONN, [&](Action action) { ... });
+ * ~~~
+ *
+ * @tparam NumStates, NumTriggers, number of values of the State and Trigger
+ * enums, which must start at 0 and have no gaps
+ */
+template <class State, State Initial, size_t NumStates, class Trigger,
+          size_t NumTriggers, class Action>
+class TableFsm {
+public:
+  /// A transition as it is listed
+  struct Trans {
+    State from_state;
+    State to_state;
+    Trigger trigger;
+    Action action;
+  };
+
+  /// A transition as it is looked up
+  struct Entry {
+    bool valid;
+    State to_state;
+    Action action;
+  };
+
+  /// Lookup table, indexed by state * NumTriggers + trigger
+  struct Table {
+    Entry entries[NumStates * NumTriggers];
+  };
+
+  /**
+   * @brief Build the lookup table from a list of transitions, meant to be
+   * evaluated at compile time
+   */
+  template <size_t N>
+  static constexpr Table MakeTable(const Trans (&transitions)[N]) {
+    Table table{};
+    for (size_t i = 0; i < N; ++i) {
+      const auto &trans = transitions[i];
+      Entry &entry = table.entries[Index(trans.from_state, trans.trigger)];
+      if (entry.valid)
+        continue;
+      entry.valid = true;
+      entry.to_state = trans.to_state;
+      entry.action = trans.action;
+    }
+    return table;
+  }
+
+  explicit TableFsm(const Table &table) : table_(&table) {}
+
+  State state() const { return state_; }
+  bool is_initial() const { return state_ == Initial; }
+  void reset(State state = Initial) { state_ = state; }
+
+  /**
+   * @brief Take the transition for trigger from the current state, calling
+   * handler(action) before changing state
+   * @return False if the current state has no such trigger, nothing is done
+   */
+  template <class Handler> bool execute(Trigger trigger, Handler &&handler) {
+    const Entry &entry = table_->entries[Index(state_, trigger)];
+    if (!entry.valid)
+      return false;
+
+    handler(entry.action);
+    state_ = entry.to_state;
+    return true;
+  }
+
+  /**
+   * @brief Take the transition for trigger without running its action
+   */
+  bool execute(Trigger trigger) {
+    return execute(trigger, [](Action) {});
+  }
+
+private:
+  static constexpr size_t Index(State state, Trigger trigger) {
+    return static_cast<size_t>(state) * NumTriggers +
+           static_cast<size_t>(trigger);
+  }
+
+  const Table *table_;
+  State state_ = Initial;
+};
+
+#endif // TABLEFSM_H
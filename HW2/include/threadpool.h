@@ -0,0 +1,64 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/**
+ * @brief The ThreadPool class, a fixed number of threads running queued tasks
+ *
+ * Tasks run in the order they were submitted. The destructor lets the
+ * threads finish every queued task before joining them.
+ */
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t num_threads);
+  ~ThreadPool();
+
+  // Disable copy constructor and copy-assignment operator
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t size() const { return threads_.size(); }
+
+  /**
+   * @brief Queue a task
+   * @return Future of the result of task
+   */
+  template <typename F>
+  std::future<typename std::result_of<F()>::type> Submit(F task);
+
+private:
+  void Loop();
+
+  std::vector<std::thread> threads_;
+  std::queue<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+};
+
+template <typename F>
+std::future<typename std::result_of<F()>::type> ThreadPool::Submit(F task) {
+  using Result = typename std::result_of<F()>::type;
+
+  // std::function needs a copyable target, packaged_task is move only
+  auto packaged =
+      std::make_shared<std::packaged_task<Result()>>(std::move(task));
+  auto future = packaged->get_future();
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    tasks_.emplace([packaged] { (*packaged)(); });
+  }
+  cv_.notify_one();
+  return future;
+}
+
+#endif // THREADPOOL_H
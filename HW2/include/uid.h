@@ -0,0 +1,50 @@
+#ifndef UID_H
+#define UID_H
+
+#ifndef UID_XXH64
+#include <openssl/md5.h>
+#endif
+
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief The UidHasher class, computes the unique id of a mail
+ *
+ * The unique id is the hash of the mail content with all line breaks removed,
+ * so content is fed line by line. It is computed once when the mail is
+ * delivered and kept in the mailbox index.
+ *
+ * MD5 is used by default. Building with UID_XXH64 defined (make UID_HASH=xxh64)
+ * switches to XXH64, which is much faster and good enough for an id that
+ * only has to be unique within one maildrop. Ids already in an index are kept
+ * as they are, only new and rescanned mails get ids from the other hash.
+ */
+class UidHasher {
+public:
+  UidHasher();
+
+  /**
+   * @brief Add one line of content, without line break
+   */
+  void Update(const char *data, size_t len);
+  void Update(const std::string &line) { Update(line.data(), line.size()); }
+
+  /**
+   * @brief Finish hashing
+   * @return unique id in hex
+   */
+  std::string Final();
+
+private:
+#ifdef UID_XXH64
+  uint64_t acc_[4];       // accumulators of the 4 lanes
+  unsigned char buf_[32]; // input not consumed yet, less than one stripe
+  size_t buf_len_ = 0;
+  uint64_t total_len_ = 0;
+#else
+  MD5_CTX ctx_;
+#endif
+};
+
+#endif // UID_H
@@ -1,18 +1,37 @@
 #ifndef USER_H
 #define USER_H
 
+#include "fileio.h"
 #include "mail.h"
+#include "mailindex.h"
 #include "maildrop.h"
 
 #include <memory>
 #include <mutex>
 #include <string>
 
+class GroupCommit;
+class Spool;
+
 using MutexPtr = std::shared_ptr<std::mutex>;
 
+/// Result of User::SendMail, after Failed part of the mail may have been sent
+enum class SendStatus { NotSupported, Sent, Failed };
+
+/**
+ * @brief The User class, a user with an mbox mailbox
+ *
+ * There are two locks. mutex() is the maildrop lock, held by a POP3 session
+ * from PASS to QUIT and by compaction. Deliveries only take a short internal
+ * lock around appending to the mbox and its index, so they never wait for a
+ * POP3 session. A session works on the mails that were there at PASS, mails
+ * appended after that are simply beyond the end of its maildrop and show up
+ * at the next login.
+ */
 class User {
 public:
   User(const std::string &mailbox, const std::string &username);
+  virtual ~User() = default;
 
   // Getters
   const std::string &mailbox() const { return mailbox_; }
@@ -21,16 +40,108 @@ public:
   const std::string &mailaddr() const { return mailaddr_; }
   const MutexPtr mutex() const { return mutex_; }
 
-  void ClearMailbox() const;
-  void WriteMail(const Mail &mail) const;
-  Maildrop ReadMaildrop() const;
+  virtual void ClearMailbox() const;
+  virtual void WriteMail(const Mail &mail) const;
+
+  /**
+   * @brief Append a mail whose content is in a spool
+   * @return False if mailbox could not be written
+   */
+  virtual bool WriteMail(const Mail &mail, const Spool &spool) const;
+
+  /**
+   * @brief Deliver a mail whose content is in a spool, takes whatever lock
+   * the mailbox needs, but never the maildrop lock. Returns once the mail is
+   * durable, the mbox is synced with others through commit
+   * @param commit, group commit for the sync, no sync if nullptr
+   * @return False if mailbox could not be written or synced
+   */
+  virtual bool Deliver(const Mail &mail, const Spool &spool,
+                       GroupCommit *commit) const;
+
+  /**
+   * @brief Read all mails from the index, without their content. The index
+   * is rebuilt from the mbox if it is out of date
+   */
+  virtual Maildrop ReadMaildrop() const;
+
+  /**
+   * @brief Read one mail with its content
+   */
+  virtual Mail ReadMail(const IndexEntry &entry) const;
+
+  /**
+   * @brief Read the header and the first num_lines lines of the body of a
+   * mail, for TOP. Reading stops there, the rest of the mail is not read
+   */
+  virtual Mail ReadTop(const IndexEntry &entry, size_t num_lines) const;
+
+  /**
+   * @brief Send content of a mail straight from the mailbox file to fd,
+   * without reading it. Only works for mails stored in wire form (crlf)
+   * @return NotSupported if mail is not in wire form, nothing was sent.
+   * Failed if it could not be sent, fd is then unusable
+   */
+  virtual SendStatus SendMail(const IndexEntry &entry, int out_fd) const;
+
+  /**
+   * @brief Save deletions of a maildrop. Only the index is rewritten, deleted
+   * mails stay in the mbox until Compact()
+   * @param compact, output, true if the mbox should be compacted
+   * @return False if deletions could not be saved
+   */
+  virtual bool CommitMaildrop(const Maildrop &maildrop, bool &compact) const;
+
+  /**
+   * @brief Remove deleted mails from the mbox
+   */
+  virtual void Compact() const;
+
+protected:
+  /**
+   * @brief Read header and num_lines body lines of content stored in fd
+   * between begin and end into mail. Read in chunks, so only about as much
+   * as is needed is read
+   */
+  static void ReadTopRange(int fd, size_t begin, size_t end, bool crlf,
+                           size_t num_lines, Mail &mail);
 
 private:
+  /**
+   * @brief Get the cached mbox fd with an exclusive flock, making sure it is
+   * still the file at the mbox path
+   * @return nullptr if mbox could not be opened or locked
+   */
+  FileFdPtr LockMailbox() const;
+
+  /**
+   * @brief Append head line and content to the mbox and the index, content
+   * is either data or spool. Fills in offset, body and end of entry. An mbox
+   * that has no index yet is indexed first
+   * @return False if mbox or index could not be written, the mbox is then
+   * truncated back so a retry doesn't store the mail twice
+   */
+  bool AppendMail(IndexEntry &entry, const std::string &head, const char *data,
+                  size_t len, const Spool *spool) const;
+
+  /**
+   * @brief Load index and bring it up to date with the mbox, caller holds
+   * delivery_mutex_
+   */
+  std::vector<IndexEntry> LoadIndex() const;
+
+  /**
+   * @brief Parse the mbox from an offset to build index entries
+   */
+  std::vector<IndexEntry> ScanMailbox(size_t from) const;
+
   std::string mailbox_;
   std::string username_;
   std::string password_;
   std::string mailaddr_;
-  MutexPtr mutex_;
+  MailIndex index_;
+  MutexPtr mutex_;                      // maildrop lock
+  mutable std::mutex delivery_mutex_;   // appends to mbox and index
 };
 
 using UserPtr = std::shared_ptr<User>;
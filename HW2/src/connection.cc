@@ -0,0 +1,125 @@
+#include "connection.h"
+#include "log.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+constexpr size_t kReadChunk = 4096;
+}
+
+Connection::Connection(int fd, bool verbose) : fd_(fd), verbose_(verbose) {}
+
+bool Connection::HasBufferedLine() const {
+  return rbuf_.find('\n', rpos_) != std::string::npos;
+}
+
+bool Connection::Fill() {
+  // Drop consumed data before growing the buffer
+  if (rpos_ > 0) {
+    rbuf_.erase(0, rpos_);
+    rpos_ = 0;
+  }
+
+  char chunk[kReadChunk];
+  for (;;) {
+    const auto n = read(fd_, chunk, sizeof(chunk));
+    if (n == -1) {
+      // Interrupted, so there might be a signal
+      if (errno == EINTR)
+        continue;
+
+      LOG_F(WARNING, "[%d] Read failed", fd_);
+      return false;
+    }
+
+    // EOF
+    if (n == 0)
+      return false;
+
+    rbuf_.append(chunk, n);
+    return true;
+  }
+}
+
+bool Connection::ReadLine(std::string &line) {
+  line.clear();
+
+  if (line_too_long_)
+    return false;
+
+  size_t lf = rbuf_.find('\n', rpos_);
+  while (lf == std::string::npos) {
+    // No line break within the limit, stop before buffering any more
+    if (rbuf_.size() - rpos_ >= max_line_)
+      break;
+
+    // Client is waiting for us, send everything we have queued
+    if (!Flush())
+      return false;
+
+    const size_t searched = rbuf_.size() - rpos_;
+    if (!Fill()) {
+      // Return whatever is left as the last line
+      if (rpos_ == rbuf_.size())
+        return false;
+      lf = rbuf_.size();
+      break;
+    }
+    lf = rbuf_.find('\n', searched);
+  }
+
+  if (lf == std::string::npos || lf - rpos_ + 1 > max_line_) {
+    LOG_F(WARNING, "[%d] Line too long, max={%zu}", fd_, max_line_);
+    line_too_long_ = true;
+    return false;
+  }
+
+  // Strip CR before LF
+  size_t end = lf;
+  if (end > rpos_ && rbuf_[end - 1] == '\r')
+    --end;
+
+  line.assign(rbuf_, rpos_, end - rpos_);
+  rpos_ = std::min(lf + 1, rbuf_.size());
+
+  LOG_F(INFO, "[%d] Read, str={%s}", fd_, line.c_str());
+  if (verbose_)
+    fprintf(stderr, "[%d] C: %s\n", fd_, line.c_str());
+
+  return true;
+}
+
+void Connection::WriteLine(const std::string &line) {
+  wbuf_ += line;
+  wbuf_ += "\r\n";
+
+  LOG_F(INFO, "[%d] Write, str={%s}", fd_, line.c_str());
+  if (verbose_)
+    fprintf(stderr, "[%d] S: %s\n", fd_, line.c_str());
+}
+
+bool Connection::Flush() {
+  const size_t len = wbuf_.size();
+  size_t num_sent = 0;
+
+  while (num_sent < len) {
+    const auto n = write(fd_, &wbuf_.data()[num_sent], len - num_sent);
+    if (n == -1) {
+      // Interrupted, restart write()
+      if (errno == EINTR)
+        continue;
+
+      // write() failed
+      LOG_F(WARNING, "[%d] Write failed", fd_);
+      wbuf_.clear();
+      return false;
+    }
+    num_sent += n;
+  }
+
+  wbuf_.clear();
+  return true;
+}
@@ -0,0 +1,315 @@
+#include "deliveryqueue.h"
+#include "fileio.h"
+#include "log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+constexpr int kMaxAttempts = 10;
+constexpr auto kFailedDir = "failed"; // mails given up on, inside the queue
+constexpr auto kFirstRetry = std::chrono::seconds(1);
+constexpr auto kMaxRetry = std::chrono::minutes(10);
+
+/**
+ * @brief Unique queue id, "sec.MusecPpidQn"
+ */
+std::string UniqueId() {
+  static std::atomic<unsigned long> counter{0};
+
+  timeval tv;
+  gettimeofday(&tv, nullptr);
+
+  std::ostringstream ss;
+  ss << tv.tv_sec << ".M" << tv.tv_usec << "P" << getpid() << "Q" << counter++;
+  return ss.str();
+}
+
+bool EndsWith(const std::string &str, const std::string &suffix) {
+  return str.size() >= suffix.size() &&
+         str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+} // namespace
+
+DeliveryQueue::DeliveryQueue(const std::string &dir, ThreadPool &pool,
+                             DeliverFn deliver)
+    : dir_(dir), pool_(pool), deliver_(std::move(deliver)) {}
+
+DeliveryQueue::~DeliveryQueue() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+std::string DeliveryQueue::Path(const std::string &id, const char *ext) const {
+  return dir_ + "/" + id + ext;
+}
+
+void DeliveryQueue::Start() {
+  if (mkdir(dir_.c_str(), 0755) == -1 && errno != EEXIST) {
+    LOG_F(ERROR, "Failed to create queue, dir={%s}", dir_.c_str());
+    return;
+  }
+  const auto failed_dir = dir_ + "/" + kFailedDir;
+  if (mkdir(failed_dir.c_str(), 0755) == -1 && errno != EEXIST)
+    LOG_F(ERROR, "Failed to create queue, dir={%s}", failed_dir.c_str());
+
+  // Only mails with an envelope were acknowledged, anything else is left
+  // from a crash in the middle of Enqueue or Remove
+  std::vector<std::string> ids;
+  std::vector<std::string> stale;
+  if (DIR *dirp = opendir(dir_.c_str())) {
+    while (const dirent *ent = readdir(dirp)) {
+      const std::string name = ent->d_name;
+      if (EndsWith(name, ".env"))
+        ids.push_back(name.substr(0, name.size() - 4));
+      else if (name[0] != '.' && name != kFailedDir)
+        stale.push_back(name);
+    }
+    closedir(dirp);
+  }
+
+  std::sort(ids.begin(), ids.end());
+  for (const auto &id : ids) {
+    auto item = Load(id);
+    if (item)
+      items_.push_back(item);
+  }
+  for (const auto &name : stale) {
+    if (EndsWith(name, ".msg") &&
+        std::binary_search(ids.begin(), ids.end(),
+                           name.substr(0, name.size() - 4)))
+      continue;
+    LOG_F(INFO, "Remove stale queue file, name={%s}", name.c_str());
+    unlink((dir_ + "/" + name).c_str());
+  }
+  LOG_F(INFO, "Start delivery queue, dir={%s}, n={%zu}", dir_.c_str(),
+        items_.size());
+
+  thread_ = std::thread([this] { Run(); });
+}
+
+DeliveryQueue::ItemPtr DeliveryQueue::Load(const std::string &id) {
+  std::ifstream env_file(Path(id, ".env"));
+  std::string uid, sender, recipient;
+  size_t size = 0, num_lines = 0;
+  long long time = 0;
+  int attempts = 0;
+  env_file >> uid >> size >> num_lines >> time >> attempts;
+  env_file.ignore(1);
+  if (!env_file || !std::getline(env_file, sender)) {
+    LOG_F(ERROR, "Corrupt queue envelope, id={%s}", id.c_str());
+    return nullptr;
+  }
+
+  auto item = std::make_shared<Item>(id, dir_);
+  item->mail.set_sender(sender);
+  item->mail.set_time(std::chrono::system_clock::from_time_t(time));
+  while (std::getline(env_file, recipient)) {
+    if (!recipient.empty())
+      item->mail.AddRecipient(recipient);
+  }
+  item->attempts = attempts;
+  item->due = Clock::now();
+
+  if (!item->spool.Load(Path(id, ".msg"), size, num_lines, uid))
+    return nullptr;
+  return item;
+}
+
+bool DeliveryQueue::SaveEnvelope(const Item &item) const {
+  const auto &mail = item.mail;
+  std::ostringstream ss;
+  ss << item.spool.uid() << ' ' << item.spool.size() << ' '
+     << item.spool.num_lines() << ' '
+     << std::chrono::system_clock::to_time_t(mail.time()) << ' '
+     << item.attempts << '\n'
+     << mail.sender() << '\n';
+  for (const auto &recipient : mail.recipients()) {
+    ss << recipient << '\n';
+  }
+  const auto data = ss.str();
+
+  // Replace the envelope atomically, it is the record of what is left to do
+  const auto tmp_path = Path(item.id, ".tmp");
+  const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    LOG_F(ERROR, "Failed to open envelope, path={%s}", tmp_path.c_str());
+    return false;
+  }
+  bool ok = WriteAll(fd, data.data(), data.size()) && fsync(fd) == 0;
+  close(fd);
+  ok = ok && std::rename(tmp_path.c_str(), Path(item.id, ".env").c_str()) == 0;
+  ok = ok && SyncDir(dir_);
+  if (!ok) {
+    LOG_F(ERROR, "Failed to save envelope, path={%s}", tmp_path.c_str());
+    unlink(tmp_path.c_str());
+  }
+  return ok;
+}
+
+bool DeliveryQueue::MoveToFailed(const Item &item) const {
+  // Content first, an envelope without content is left alone at start while
+  // content without envelope would be removed
+  const auto failed_dir = dir_ + "/" + kFailedDir;
+  for (const auto *ext : {".msg", ".env"}) {
+    const auto path = Path(item.id, ext);
+    const auto failed_path = failed_dir + "/" + item.id + ext;
+    // A file may have been moved by an earlier try that failed halfway
+    if (std::rename(path.c_str(), failed_path.c_str()) != 0 &&
+        !(errno == ENOENT && access(failed_path.c_str(), F_OK) == 0)) {
+      LOG_F(ERROR, "Failed to move mail, path={%s}, to={%s}", path.c_str(),
+            failed_path.c_str());
+      return false;
+    }
+  }
+  return SyncDir(failed_dir) && SyncDir(dir_);
+}
+
+void DeliveryQueue::Remove(const Item &item) const {
+  // Envelope first, a content file without envelope is removed at start
+  unlink(Path(item.id, ".env").c_str());
+  unlink(Path(item.id, ".msg").c_str());
+}
+
+bool DeliveryQueue::Enqueue(const Mail &mail, Spool &spool) {
+  const auto id = UniqueId();
+  auto item = std::make_shared<Item>(id, dir_);
+  item->mail.set_sender(mail.sender());
+  item->mail.set_time(mail.time());
+  for (const auto &recipient : mail.recipients()) {
+    item->mail.AddRecipient(recipient);
+  }
+
+  const auto msg_path = Path(id, ".msg");
+  if (!spool.Commit(msg_path))
+    return false;
+
+  if (!item->spool.Load(msg_path, spool.size(), spool.num_lines(),
+                        spool.uid()) ||
+      !SaveEnvelope(*item)) {
+    unlink(msg_path.c_str());
+    return false;
+  }
+
+  item->due = Clock::now();
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    items_.push_back(item);
+  }
+  cv_.notify_one();
+  LOG_F(INFO, "Queue mail, id={%s}, n={%zu}", id.c_str(),
+        mail.recipients().size());
+  return true;
+}
+
+void DeliveryQueue::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    // Everything that is due goes out in one batch
+    const auto now = Clock::now();
+    std::vector<ItemPtr> batch;
+    auto next = Clock::time_point::max();
+    for (auto it = items_.begin(); it != items_.end();) {
+      if ((*it)->due <= now) {
+        batch.push_back(*it);
+        it = items_.erase(it);
+      } else {
+        next = std::min(next, (*it)->due);
+        ++it;
+      }
+    }
+
+    if (batch.empty()) {
+      if (next == Clock::time_point::max())
+        cv_.wait(lock);
+      else
+        cv_.wait_until(lock, next);
+      continue;
+    }
+
+    lock.unlock();
+    DeliverBatch(batch);
+    lock.lock();
+  }
+}
+
+void DeliveryQueue::DeliverBatch(const std::vector<ItemPtr> &batch) {
+  std::vector<std::vector<std::future<bool>>> results(batch.size());
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const auto &item = batch[i];
+    // One mapping of the content for all copies
+    if (item->mail.recipients().size() > 1)
+      item->spool.Map();
+    for (const auto &recipient : item->mail.recipients()) {
+      results[i].push_back(pool_.Submit([this, item, &recipient] {
+        return deliver_(item->mail, item->spool, recipient);
+      }));
+    }
+  }
+
+  std::vector<ItemPtr> retry;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const auto &item = batch[i];
+    Mail left(item->mail.sender());
+    left.set_time(item->mail.time());
+    for (size_t j = 0; j < results[i].size(); ++j) {
+      if (!results[i][j].get())
+        left.AddRecipient(item->mail.recipients()[j]);
+    }
+
+    if (left.recipients().empty()) {
+      LOG_F(INFO, "Delivered mail, id={%s}", item->id.c_str());
+      Remove(*item);
+      continue;
+    }
+
+    item->mail = left;
+    if (++item->attempts >= kMaxAttempts) {
+      // The mail was acknowledged, keep it for someone to look at, with the
+      // recipients it never reached in its envelope
+      std::string recipients;
+      for (const auto &recipient : left.recipients()) {
+        recipients += recipients.empty() ? "" : ",";
+        recipients += recipient;
+      }
+      LOG_F(ERROR, "Give up delivering mail, id={%s}, rcpt={%s}",
+            item->id.c_str(), recipients.c_str());
+      if (SaveEnvelope(*item) && MoveToFailed(*item))
+        continue;
+
+      // Keep trying at the longest delay rather than lose it
+      item->attempts = kMaxAttempts - 1;
+    }
+
+    // Try the failed recipients again later, waiting longer each time
+    item->due = Clock::now() +
+                std::min<Clock::duration>(kFirstRetry * (1 << item->attempts),
+                                          kMaxRetry);
+    SaveEnvelope(*item);
+    LOG_F(WARNING, "Retry mail later, id={%s}, attempts={%d}, n={%zu}",
+          item->id.c_str(), item->attempts, left.recipients().size());
+    retry.push_back(item);
+  }
+
+  if (!retry.empty()) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    items_.insert(items_.end(), retry.begin(), retry.end());
+  }
+}
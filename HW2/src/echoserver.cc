@@ -9,6 +9,8 @@
 #define LOGURU_IMPLEMENTATION 1
 #include "loguru.hpp"
 
+#include "log.h"
+
 EchoServer *echo_server_ptr = nullptr;
 
 void EchoServer::Work(SocketPtr sock_ptr) {
@@ -67,7 +69,7 @@ struct argp_args {
   bool print_name = false; // print name and seas login to stderr
   bool verbose = false;    // verbose mode
   bool logstderr = false;  // log to stderr, otherwise log to file
-  int backlog = 10;        // backlog option to listen
+  ServerOptions server;    // -b -w -q -n
 };
 
 struct argp_option options[] = {
@@ -75,12 +77,16 @@ struct argp_option options[] = {
     {0, 'a', 0, 0, "Print name and seas login to stderr."},
     {0, 'v', 0, 0, "Verbose mode."},
     {0, 'l', 0, 0, "Log to stderr."},
-    {0, 'b', "BACKLOG", 0, "Number of connections on incoming queue."},
     {0}};
 
+struct argp_child children[] = {{&server_argp, 0, 0, 0}, {0}};
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   struct argp_args *args = (struct argp_args *)state->input;
   switch (key) {
+  case ARGP_KEY_INIT:
+    state->child_inputs[0] = &args->server;
+    break;
   case 'p':
     args->port_no = std::atoi(arg);
     break;
@@ -93,9 +99,6 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   case 'l':
     args->logstderr = true;
     break;
-  case 'b':
-    args->backlog = std::atoi(arg);
-    break;
   default:
     return ARGP_ERR_UNKNOWN;
   }
@@ -105,7 +108,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 argp_args ParseCmdArguments(int argc, char **argv) {
   // Parse command line arguments
   struct argp_args args;
-  struct argp argp_ = {options, parse_opt, 0, 0};
+  struct argp argp_ = {options, parse_opt, 0, 0, children};
   int status = argp_parse(&argp_, argc, argv, 0, 0, &args);
 
   if (status)
@@ -130,15 +133,17 @@ int main(int argc, char *argv[]) {
   // Setup log
   if (!args.logstderr) {
     loguru::g_stderr_verbosity = loguru::Verbosity_OFF;
-    loguru::add_file("echoserver.log", loguru::Truncate, loguru::Verbosity_MAX);
+    AsyncLog::AddFile("echoserver.log", loguru::Verbosity_MAX);
   }
 
   SetSigintHandler(SigintHandler);
 
   // EchoServer
-  EchoServer echo_server(args.port_no, args.backlog, args.verbose);
+  EchoServer echo_server(args.port_no, args.server.backlog, args.verbose);
   echo_server_ptr = &echo_server;
 
+  echo_server.SetWorkers(args.server.workers, args.server.pending);
+  echo_server.SetAcceptors(args.server.acceptors);
   echo_server.Setup();
   echo_server.Run();
 
@@ -0,0 +1,177 @@
+#include "fileio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+constexpr size_t kChunkSize = 64 * 1024;
+}
+
+bool WriteAll(int fd, const char *data, size_t len) {
+  size_t num_written = 0;
+  while (num_written < len) {
+    const auto n = write(fd, data + num_written, len - num_written);
+    if (n == -1) {
+      // Interrupted, restart write()
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    num_written += n;
+  }
+  return true;
+}
+
+bool CopyRange(int in_fd, off_t offset, size_t len, int out_fd) {
+  std::vector<char> chunk(std::min(len, kChunkSize));
+  while (len > 0) {
+    const auto n = pread(in_fd, chunk.data(), std::min(len, chunk.size()),
+                         offset);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+
+    // File is shorter than expected
+    if (n == 0)
+      return false;
+
+    if (!WriteAll(out_fd, chunk.data(), n))
+      return false;
+    offset += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool SendRange(int in_fd, off_t offset, size_t len, int out_fd) {
+  bool sent_any = false;
+  while (len > 0) {
+    const auto n = sendfile(out_fd, in_fd, &offset, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      // Not supported for these fds, nothing is sent yet so copy instead
+      if (!sent_any && (errno == EINVAL || errno == ENOSYS))
+        return CopyRange(in_fd, offset, len, out_fd);
+      return false;
+    }
+
+    // File is shorter than expected
+    if (n == 0)
+      return false;
+
+    sent_any = true;
+    len -= n;
+  }
+  return true;
+}
+
+bool SyncDir(const std::string &dir) {
+  const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return false;
+  const bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+size_t FileSize(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1)
+    return 0;
+  return st.st_size;
+}
+
+MappedFile::MappedFile(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    size_ = st.st_size;
+    if (size_ == 0) {
+      ok_ = true;
+    } else {
+      void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        // Mostly read front to back
+        madvise(addr, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char *>(addr);
+        ok_ = true;
+      }
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr)
+    munmap(const_cast<char *>(data_), size_);
+}
+
+bool IsSameFile(int fd, const std::string &path) {
+  struct stat fd_st, path_st;
+  return fstat(fd, &fd_st) == 0 && stat(path.c_str(), &path_st) == 0 &&
+         fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino;
+}
+
+FileFd::~FileFd() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+FdCache &FdCache::Global() {
+  // Leave most of the fds to sockets and files opened elsewhere. Never
+  // destroyed, delivery threads may still use it while exit() runs
+  static FdCache *cache = new FdCache([] {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 ||
+        limit.rlim_cur == RLIM_INFINITY)
+      return size_t{256};
+    return std::max<size_t>(16, limit.rlim_cur / 4);
+  }());
+  return *cache;
+}
+
+FileFdPtr FdCache::Get(const std::string &path, bool create) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = files_.find(path);
+  if (it != files_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->second;
+  }
+
+  const int flags = O_RDWR | O_APPEND | (create ? O_CREAT : 0);
+  const int fd = open(path.c_str(), flags, 0644);
+  if (fd < 0)
+    return nullptr;
+
+  auto file = std::make_shared<const FileFd>(fd);
+  lru_.emplace_front(path, file);
+  files_[path] = lru_.begin();
+  if (lru_.size() > capacity_) {
+    files_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  return file;
+}
+
+void FdCache::Evict(const std::string &path) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = files_.find(path);
+  if (it == files_.end())
+    return;
+  lru_.erase(it->second);
+  files_.erase(it);
+}
@@ -0,0 +1,79 @@
+#include "groupcommit.h"
+#include "fileio.h"
+#include "log.h"
+
+#include <unistd.h>
+
+#include <map>
+
+GroupCommit::GroupCommit(std::chrono::microseconds window, size_t max_bytes)
+    : window_(window), max_bytes_(max_bytes), thread_([this] { Run(); }) {}
+
+GroupCommit::~GroupCommit() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+std::future<bool> GroupCommit::Sync(const std::string &path, size_t bytes) {
+  Request request;
+  request.path = path;
+  auto future = request.done.get_future();
+
+  bool notify;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (pending_.empty())
+      first_ = std::chrono::steady_clock::now();
+    pending_.push_back(std::move(request));
+    pending_bytes_ += bytes;
+    // Wake up the thread to start a batch, or end it early when full. In
+    // between it wakes up by itself when the window is over
+    notify = pending_.size() == 1 || pending_bytes_ >= max_bytes_;
+  }
+
+  if (notify)
+    cv_.notify_one();
+  return future;
+}
+
+void GroupCommit::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+    if (pending_.empty())
+      return;
+
+    // Collect more requests until the window is over or enough is waiting
+    cv_.wait_until(lock, first_ + window_, [this] {
+      return stop_ || pending_bytes_ >= max_bytes_;
+    });
+
+    std::vector<Request> batch;
+    batch.swap(pending_);
+    pending_bytes_ = 0;
+    lock.unlock();
+
+    // One sync per file, however many appends it had
+    std::map<std::string, bool> synced;
+    for (const auto &request : batch) {
+      synced.emplace(request.path, false);
+    }
+    for (auto &file : synced) {
+      const auto fd = FdCache::Global().Get(file.first);
+      file.second = fd && fdatasync(fd->fd()) == 0;
+      if (!file.second)
+        LOG_F(ERROR, "Failed to sync, path={%s}", file.first.c_str());
+    }
+    LOG_F(INFO, "Group commit, n={%zu}, files={%zu}", batch.size(),
+          synced.size());
+
+    for (auto &request : batch) {
+      request.done.set_value(synced[request.path]);
+    }
+    lock.lock();
+  }
+}
@@ -0,0 +1,121 @@
+#include "log.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+constexpr size_t kRingSize = 1 << 20; // power of two
+constexpr auto kWriteInterval = std::chrono::milliseconds(10);
+constexpr auto kCallbackId = "async_file";
+
+AsyncLog *g_log = nullptr; // the log added by AddFile
+
+void LogCallback(void *user_data, const loguru::Message &message) {
+  static_cast<AsyncLog *>(user_data)->Push(message);
+}
+
+void CloseCallback(void *user_data) {
+  auto *log = static_cast<AsyncLog *>(user_data);
+  if (log == g_log)
+    g_log = nullptr;
+  delete log;
+}
+
+void FatalHandler(const loguru::Message &) {
+  if (g_log != nullptr)
+    g_log->Wait();
+}
+
+} // namespace
+
+bool AsyncLog::AddFile(const std::string &path, loguru::Verbosity verbosity) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    LOG_F(ERROR, "Failed to open log, path={%s}", path.c_str());
+    return false;
+  }
+
+  g_log = new AsyncLog(file);
+  loguru::add_callback(kCallbackId, LogCallback, g_log, verbosity,
+                       CloseCallback);
+  // Last words before an abort should make it to the file
+  loguru::set_fatal_handler(FatalHandler);
+  // Removing the callback deletes the log, which writes out the rest
+  atexit([] { loguru::remove_callback(kCallbackId); });
+  return true;
+}
+
+AsyncLog::AsyncLog(FILE *file)
+    : file_(file), ring_(kRingSize), thread_([this] { Run(); }) {}
+
+AsyncLog::~AsyncLog() {
+  stop_ = true;
+  thread_.join();
+  fclose(file_);
+}
+
+void AsyncLog::Push(const loguru::Message &message) {
+  const char *parts[] = {message.preamble, message.indentation,
+                         message.prefix, message.message, "\n"};
+  size_t len = 0;
+  for (const char *part : parts)
+    len += strlen(part);
+
+  size_t head = head_.load(std::memory_order_relaxed);
+  const size_t tail = tail_.load(std::memory_order_acquire);
+  if (len > kRingSize - (head - tail)) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  // Copy each part, wrapping around the end of the ring
+  for (const char *part : parts) {
+    for (size_t n = strlen(part); n > 0;) {
+      const size_t pos = head & (kRingSize - 1);
+      const size_t chunk = std::min(n, kRingSize - pos);
+      memcpy(&ring_[pos], part, chunk);
+      part += chunk;
+      head += chunk;
+      n -= chunk;
+    }
+  }
+  head_.store(head, std::memory_order_release);
+}
+
+void AsyncLog::Wait() const {
+  while (tail_.load(std::memory_order_acquire) !=
+         head_.load(std::memory_order_acquire))
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+void AsyncLog::Run() {
+  for (;;) {
+    // Checked before draining, so everything pushed before stop is written
+    const bool stop = stop_;
+    if (!Drain() && stop)
+      return;
+    std::this_thread::sleep_for(kWriteInterval);
+  }
+}
+
+bool AsyncLog::Drain() {
+  const size_t head = head_.load(std::memory_order_acquire);
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  const size_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+  if (head == tail && dropped == 0)
+    return false;
+
+  while (tail != head) {
+    const size_t pos = tail & (kRingSize - 1);
+    const size_t chunk = std::min(head - tail, kRingSize - pos);
+    fwrite(&ring_[pos], 1, chunk, file_);
+    tail += chunk;
+  }
+  if (dropped > 0)
+    fprintf(file_, "Log full, dropped %zu messages\n", dropped);
+  fflush(file_);
+
+  tail_.store(tail, std::memory_order_release);
+  return true;
+}
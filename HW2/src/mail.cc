@@ -1,20 +1,33 @@
 #include "mail.h"
 
 #include <algorithm>
-#include <iomanip>
+#include <cstdio>
+#include <cstring>
 
 Mail::Mail(const std::string &sender) : sender_(sender) {}
 
 void Mail::Clear() {
   sender_.clear();
   recipients_.clear();
-  lines_.clear();
+  body_.clear();
+  line_ends_.clear();
+  entry_ = IndexEntry();
 }
 
 void Mail::SetTimeFromString(const std::string &time_str) {
+  // Same format as ctime(), "Thu Feb 23 20:54:38 2017"
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
   std::tm tm = {};
-  std::stringstream ss(time_str);
-  ss >> std::get_time(&tm, "%a %b %d %H:%M:%S %Y");
+  char month[4] = {};
+  int year = 1900;
+  if (std::sscanf(time_str.c_str(), "%*3s %3s %d %d:%d:%d %d", month,
+                  &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+                  &year) == 6) {
+    const char *m = std::strstr(months, month);
+    if (m != nullptr && std::strlen(month) == 3)
+      tm.tm_mon = (m - months) / 3;
+    tm.tm_year = year - 1900;
+  }
   time_ = std::chrono::system_clock::from_time_t(std::mktime(&tm));
 }
 
@@ -24,7 +37,7 @@ bool Mail::RecipientExists(const std::string &mailaddr) const {
 }
 
 bool Mail::Empty() const {
-  return sender_.empty() && recipients_.empty() && lines_.empty();
+  return sender_.empty() && recipients_.empty() && line_ends_.empty();
 }
 
 std::string Mail::TimeStr() const {
@@ -32,18 +45,22 @@ std::string Mail::TimeStr() const {
   return std::string(std::ctime(&time));
 }
 
-size_t Mail::Octets() const {
-  size_t n = 0;
-  for (const auto &line : lines_) {
-    n += (line.size() + 2);
-  }
-  return n;
+void Mail::AddLine(const char *data, size_t len) {
+  body_.append(data, len);
+  line_ends_.push_back(body_.size());
+  body_ += "\r\n";
+}
+
+void Mail::Reserve(size_t octets, size_t num_lines) {
+  body_.reserve(octets);
+  line_ends_.reserve(num_lines);
 }
 
 std::string Mail::Data() const {
   std::string data;
-  for (const auto &line : lines_) {
-    data += line;
+  data.reserve(body_.size());
+  for (size_t i = 0; i < NumLines(); ++i) {
+    data.append(LineData(i), LineSize(i));
   }
   return data;
 }
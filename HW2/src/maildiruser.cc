@@ -0,0 +1,257 @@
+#include "maildiruser.h"
+#include "fileio.h"
+#include "log.h"
+#include "spool.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+/**
+ * @brief Unique file name as described in the Maildir spec,
+ * "sec.MusecPpidQn.host"
+ */
+std::string UniqueName() {
+  static std::atomic<unsigned long> counter{0};
+
+  timeval tv;
+  gettimeofday(&tv, nullptr);
+  char host[256] = "localhost";
+  gethostname(host, sizeof(host) - 1);
+
+  std::ostringstream ss;
+  ss << tv.tv_sec << ".M" << tv.tv_usec << "P" << getpid() << "Q"
+     << counter++ << "." << host;
+  return ss.str();
+}
+
+bool IsDirectory(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * @brief List regular file names in dir, sorted so older mails come first
+ */
+std::vector<std::string> ListFiles(const std::string &dir) {
+  std::vector<std::string> names;
+  DIR *dirp = opendir(dir.c_str());
+  if (dirp == nullptr)
+    return names;
+
+  while (const dirent *ent = readdir(dirp)) {
+    if (ent->d_name[0] != '.')
+      names.emplace_back(ent->d_name);
+  }
+  closedir(dirp);
+
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+/**
+ * @brief Unique part of a file name, before ',' or ':'
+ */
+std::string BaseName(const std::string &name) {
+  return name.substr(0, name.find_first_of(",:"));
+}
+
+/**
+ * @brief Get the value of a ",K=value" field of a file name
+ * @return False if file name has no such field
+ */
+bool NameField(const std::string &name, char key, size_t &value) {
+  const std::string field = std::string(",") + key + "=";
+  const auto pos = name.find(field);
+  if (pos == std::string::npos)
+    return false;
+  value = std::strtoull(name.c_str() + pos + field.size(), nullptr, 10);
+  return true;
+}
+
+/**
+ * @brief Octets of a mail file that was not delivered by us
+ */
+size_t CountOctets(const std::string &path) {
+  std::ifstream file(path);
+  std::string line;
+  size_t octets = 0;
+  while (std::getline(file, line)) {
+    octets += line.size() + 2;
+  }
+  return octets;
+}
+
+} // namespace
+
+MaildirUser::MaildirUser(const std::string &maildir,
+                         const std::string &username)
+    : User(maildir, username), tmp_dir_(maildir + "/tmp/"),
+      new_dir_(maildir + "/new/"), cur_dir_(maildir + "/cur/") {}
+
+bool MaildirUser::IsMaildir(const std::string &dir) {
+  return IsDirectory(dir + "/tmp") && IsDirectory(dir + "/new") &&
+         IsDirectory(dir + "/cur");
+}
+
+template <typename Writer>
+bool MaildirUser::WriteFile(size_t octets, Writer writer) const {
+  const auto base = UniqueName();
+  const auto tmp_path = tmp_dir_ + base;
+  const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    LOG_F(ERROR, "Failed to create mail, path={%s}", tmp_path.c_str());
+    return false;
+  }
+
+  bool ok = writer(fd);
+  ok = ok && fsync(fd) == 0;
+  close(fd);
+
+  const auto new_path =
+      new_dir_ + base + ",S=" + std::to_string(FileSize(tmp_path)) +
+      ",W=" + std::to_string(octets);
+  if (!ok || std::rename(tmp_path.c_str(), new_path.c_str()) != 0) {
+    LOG_F(ERROR, "Failed to deliver mail, path={%s}", tmp_path.c_str());
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void MaildirUser::WriteMail(const Mail &mail) const {
+  // Content is already in wire form
+  const auto &data = mail.body();
+  WriteFile(mail.Octets(), [&data](int fd) {
+    return WriteAll(fd, data.data(), data.size());
+  });
+}
+
+bool MaildirUser::WriteMail(const Mail &mail, const Spool &spool) const {
+  return WriteFile(spool.octets(),
+                   [&spool](int fd) { return spool.CopyTo(fd); });
+}
+
+bool MaildirUser::Deliver(const Mail &mail, const Spool &spool,
+                          GroupCommit *commit) const {
+  // Every mail is its own file, no lock needed. The file is synced before it
+  // is moved into new/, so there is nothing to commit
+  return WriteMail(mail, spool);
+}
+
+Maildrop MaildirUser::ReadMaildrop() const {
+  // Everything in new/ is seen by this session
+  for (const auto &name : ListFiles(new_dir_)) {
+    const auto cur_name = name + ":2,";
+    if (std::rename((new_dir_ + name).c_str(), (cur_dir_ + cur_name).c_str()))
+      LOG_F(WARNING, "Failed to move mail, name={%s}", name.c_str());
+  }
+
+  Maildrop maildrop;
+  for (const auto &name : ListFiles(cur_dir_)) {
+    IndexEntry entry;
+    entry.file = cur_dir_ + name;
+    if (!NameField(name, 'S', entry.end))
+      entry.end = FileSize(entry.file);
+    if (!NameField(name, 'W', entry.octets))
+      entry.octets = CountOctets(entry.file);
+    entry.uid = BaseName(name);
+    // File is in wire form if its size is the octet count
+    entry.crlf = entry.end == entry.octets;
+    maildrop.AddEntry(entry);
+  }
+  return maildrop;
+}
+
+Mail MaildirUser::ReadMail(const IndexEntry &entry) const {
+  Mail mail;
+  mail.set_entry(entry);
+  mail.AddRecipient(mailaddr());
+
+  std::ifstream file(entry.file);
+  std::string line;
+  mail.Reserve(entry.octets, entry.crlf ? 0 : entry.octets - entry.end);
+  while (std::getline(file, line)) {
+    if (entry.crlf && !line.empty() && line.back() == '\r')
+      line.pop_back();
+    mail.AddLine(line);
+  }
+  return mail;
+}
+
+Mail MaildirUser::ReadTop(const IndexEntry &entry, size_t num_lines) const {
+  Mail mail;
+  mail.set_entry(entry);
+  mail.AddRecipient(mailaddr());
+
+  const int fd = open(entry.file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG_F(ERROR, "Failed to open mail, path={%s}", entry.file.c_str());
+    return mail;
+  }
+
+  ReadTopRange(fd, 0, entry.end, entry.crlf, num_lines, mail);
+  close(fd);
+  return mail;
+}
+
+SendStatus MaildirUser::SendMail(const IndexEntry &entry, int out_fd) const {
+  if (!entry.crlf)
+    return SendStatus::NotSupported;
+
+  const int fd = open(entry.file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG_F(ERROR, "Failed to open mail, path={%s}", entry.file.c_str());
+    return SendStatus::Failed;
+  }
+
+  const bool ok = SendRange(fd, 0, entry.end, out_fd);
+  close(fd);
+  return ok ? SendStatus::Sent : SendStatus::Failed;
+}
+
+bool MaildirUser::CommitMaildrop(const Maildrop &maildrop,
+                                 bool &compact) const {
+  // Nothing to compact
+  compact = false;
+
+  bool ok = true;
+  bool any_deleted = false;
+  for (size_t i = 0; i < maildrop.NumMails(true); ++i) {
+    if (!maildrop.IsDeleted(i))
+      continue;
+    const auto &file = maildrop.GetEntry(i).file;
+    if (unlink(file.c_str()) != 0 && errno != ENOENT) {
+      LOG_F(ERROR, "Failed to delete mail, path={%s}", file.c_str());
+      ok = false;
+    }
+    any_deleted = true;
+  }
+
+  // Make the removals durable
+  if (any_deleted && !(SyncDir(new_dir_) && SyncDir(cur_dir_))) {
+    LOG_F(ERROR, "Failed to sync maildir, dir={%s}", cur_dir_.c_str());
+    ok = false;
+  }
+  return ok;
+}
+
+void MaildirUser::ClearMailbox() const {
+  for (const auto *dir : {&new_dir_, &cur_dir_}) {
+    for (const auto &name : ListFiles(*dir)) {
+      unlink((*dir + name).c_str());
+    }
+  }
+}
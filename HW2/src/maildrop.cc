@@ -1,27 +1,41 @@
 #include "maildrop.h"
 
-size_t Maildrop::TotalOctets(bool count_deleted) const {
-  size_t n = 0;
-  for (const Mail &mail : mails_) {
-    if (count_deleted || !mail.deleted()) {
-      n += mail.Octets();
-    }
-  }
-  return n;
+#include <algorithm>
+
+void Maildrop::AddEntry(const IndexEntry &entry) {
+  entries_.push_back(entry);
+  deleted_.push_back(false);
+  total_octets_ += entry.octets;
+}
+
+void Maildrop::Clear() {
+  entries_.clear();
+  deleted_.clear();
+  total_octets_ = 0;
+  deleted_octets_ = 0;
+  num_deleted_ = 0;
 }
 
-size_t Maildrop::NumMails(bool count_deleted) const {
-  size_t n = 0;
-  for (const Mail &mail : mails_) {
-    if (count_deleted || !mail.deleted()) {
-      ++n;
-    }
-  }
-  return n;
+void Maildrop::MarkDeleted(size_t i) {
+  if (deleted_[i])
+    return;
+
+  deleted_[i] = true;
+  deleted_octets_ += entries_[i].octets;
+  ++num_deleted_;
+}
+
+void Maildrop::MarkUndeleted(size_t i) {
+  if (!deleted_[i])
+    return;
+
+  deleted_[i] = false;
+  deleted_octets_ -= entries_[i].octets;
+  --num_deleted_;
 }
 
-void Maildrop::Reset() const {
-  for (const Mail &mail : mails_) {
-    mail.MarkUndeleted();
-  }
+void Maildrop::Reset() {
+  std::fill(deleted_.begin(), deleted_.end(), false);
+  deleted_octets_ = 0;
+  num_deleted_ = 0;
 }
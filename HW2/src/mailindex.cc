@@ -0,0 +1,109 @@
+#include "mailindex.h"
+#include "log.h"
+#include "fileio.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+std::string FormatEntry(const IndexEntry &entry) {
+  std::ostringstream ss;
+  ss << entry.offset << ' ' << entry.body << ' ' << entry.end << ' '
+     << entry.octets << ' ' << entry.uid << ' ' << entry.deleted << ' '
+     << entry.crlf << '\n';
+  return ss.str();
+}
+
+} // namespace
+
+bool MailIndex::Load(std::vector<IndexEntry> &entries) const {
+  entries.clear();
+
+  std::ifstream index_file(path_);
+  if (!index_file)
+    return false;
+
+  // Mails follow each other from the start of the mbox, a gap means the index
+  // missed something, e.g. it was created by an append to an mbox that was
+  // never indexed
+  std::string line;
+  size_t last_end = 0;
+  while (std::getline(index_file, line)) {
+    IndexEntry entry;
+    std::istringstream ss(line);
+    if (!(ss >> entry.offset >> entry.body >> entry.end >> entry.octets >>
+          entry.uid) ||
+        entry.offset != last_end || entry.body < entry.offset ||
+        entry.end < entry.body) {
+      LOG_F(WARNING, "Corrupt index, path={%s}", path_.c_str());
+      entries.clear();
+      return false;
+    }
+
+    // Older index has no deleted or crlf flag
+    int deleted = 0;
+    if (ss >> deleted)
+      entry.deleted = deleted != 0;
+    int crlf = 0;
+    if (ss >> crlf)
+      entry.crlf = crlf != 0;
+
+    last_end = entry.end;
+    entries.push_back(std::move(entry));
+  }
+
+  return true;
+}
+
+bool MailIndex::Exists() const { return access(path_.c_str(), F_OK) == 0; }
+
+bool MailIndex::Save(const std::vector<IndexEntry> &entries) const {
+  std::string data;
+  for (const auto &entry : entries) {
+    data += FormatEntry(entry);
+  }
+
+  // Write to a temporary file and rename, so readers never see half of it
+  const auto tmp_path = path_ + ".tmp";
+  const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    LOG_F(ERROR, "Failed to open index, path={%s}", tmp_path.c_str());
+    return false;
+  }
+
+  // Data must be on disk before the rename makes it the index, and the
+  // rename is only durable once the directory is synced
+  bool ok = WriteAll(fd, data.data(), data.size()) && fsync(fd) == 0;
+  close(fd);
+  if (!ok || std::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    LOG_F(ERROR, "Failed to save index, path={%s}", path_.c_str());
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  const auto slash = path_.rfind('/');
+  const auto dir = slash == std::string::npos ? "." : path_.substr(0, slash);
+  if (!SyncDir(dir)) {
+    LOG_F(ERROR, "Failed to sync index dir, path={%s}", path_.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool MailIndex::Append(const IndexEntry &entry) const {
+  const int fd = open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd < 0) {
+    LOG_F(ERROR, "Failed to open index, path={%s}", path_.c_str());
+    return false;
+  }
+
+  const auto line = FormatEntry(entry);
+  const bool ok = WriteAll(fd, line.data(), line.size());
+  close(fd);
+  return ok;
+}
@@ -1,7 +1,11 @@
 #include "mailserver.h"
-#include "loguru.hpp"
+#include "log.h"
+#include "maildiruser.h"
+
+#include <errno.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
-#include <algorithm>
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
 
@@ -13,9 +17,35 @@ MailServer::MailServer(int port_no, int backlog, bool verbose,
   } else {
     LOG_F(INFO, "Mailbox, dir={%s}", mailbox_.c_str());
   }
+  users_ = std::make_shared<const UserTable>();
+}
+
+MailServer::~MailServer() {
+  if (watch_fd_ >= 0) {
+    // Removing the watch sends IN_IGNORED, which stops the watch thread
+    inotify_rm_watch(watch_fd_, watch_wd_);
+    watch_thread_.join();
+    close(watch_fd_);
+  }
 }
 
 void MailServer::LoadMailbox() {
+  std::lock_guard<std::mutex> guard(load_mutex_);
+  const auto old_users = users();
+  auto table = std::make_shared<UserTable>();
+
+  // Keep the same User, and so the same lock, for a user that already exists
+  auto add_user = [&](const UserPtr &user) {
+    const auto old_iter = old_users->by_username.find(user->username());
+    if (old_iter != old_users->by_username.end() &&
+        old_iter->second->mailbox() == user->mailbox()) {
+      table->users.push_back(old_iter->second);
+    } else {
+      table->users.push_back(user);
+      LOG_F(INFO, "Add user, name={%s}", user->username().c_str());
+    }
+  };
+
   // Current working dir
   fs::path cwd(fs::current_path());
   LOG_F(INFO, "Current path, dir={%s}", cwd.c_str());
@@ -32,19 +62,135 @@ void MailServer::LoadMailbox() {
       const fs::path &mailbox = file.path();
       if (mailbox.extension().string() == ".mbox") {
         const auto &name = mailbox.stem().string();
-        users_.push_back(std::make_shared<User>(mailbox.string(), name));
-        LOG_F(INFO, "Add user, name={%s}", name.c_str());
+        add_user(std::make_shared<User>(mailbox.string(), name));
+      } else if (fs::is_directory(mailbox) &&
+                 mailbox.filename().string()[0] != '.' &&
+                 MaildirUser::IsMaildir(mailbox.string())) {
+        // A directory <name>/ with tmp/, new/ and cur/ is a Maildir
+        const auto &name = mailbox.filename().string();
+        add_user(std::make_shared<MaildirUser>(mailbox.string(), name));
+      }
+    }
+
+    // Spool lives next to the mailboxes so it is on the same file system
+    if (spool_dir_.empty()) {
+      const fs::path spool_dir = mailbox_dir / ".spool";
+      std::error_code ec;
+      fs::create_directories(spool_dir, ec);
+      if (ec) {
+        LOG_F(ERROR, "Failed to create spool, path={%s}", spool_dir.c_str());
       }
+      spool_dir_ = spool_dir.string();
     }
   } else {
     LOG_F(ERROR, "Mailbox invalid, path={%s}", mailbox_dir.c_str());
   }
 
-  if (users_.empty()) {
+  if (table->users.empty()) {
     LOG_F(ERROR, "No user found, mbox={%s}", mailbox_.c_str());
   }
+
+  // Index users for lookup
+  table->by_mailaddr.reserve(table->users.size());
+  table->by_username.reserve(table->users.size());
+  for (const auto &user : table->users) {
+    table->by_mailaddr.emplace(user->mailaddr(), user);
+    table->by_username.emplace(user->username(), user);
+  }
   LOG_F(INFO, "Total user, mbox={%s}, n={%zu}", mailbox_.c_str(),
-        users_.size());
+        table->users.size());
+
+  // Publish, readers holding the old table keep using it until they are done
+  std::lock_guard<std::mutex> users_guard(users_mutex_);
+  users_ = std::move(table);
+  users_gen_.fetch_add(1, std::memory_order_release);
+}
+
+UserTablePtr MailServer::users() const {
+  // Each thread keeps the last table it saw and only copies users_, under
+  // its mutex, after a reload bumped the generation. The shared_ptr
+  // atomic_load of libstdc++ takes a mutex from a global pool on every call.
+  // A thread holds on to an old table until its next lookup
+  struct Snapshot {
+    const MailServer *server = nullptr;
+    uint64_t gen = 0;
+    UserTablePtr table;
+  };
+  thread_local Snapshot snapshot;
+
+  if (snapshot.server != this ||
+      snapshot.gen != users_gen_.load(std::memory_order_acquire) ||
+      !snapshot.table) {
+    std::lock_guard<std::mutex> guard(users_mutex_);
+    snapshot.server = this;
+    snapshot.gen = users_gen_.load(std::memory_order_relaxed);
+    snapshot.table = users_;
+  }
+  return snapshot.table;
+}
+
+void MailServer::WatchMailbox() {
+  watch_fd_ = inotify_init1(IN_CLOEXEC);
+  if (watch_fd_ < 0) {
+    LOG_F(ERROR, "Failed to init inotify, users will not be reloaded");
+    return;
+  }
+
+  const auto mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+  watch_wd_ = inotify_add_watch(watch_fd_, mailbox_.c_str(), mask);
+  if (watch_wd_ < 0) {
+    LOG_F(ERROR, "Failed to watch mailbox, dir={%s}", mailbox_.c_str());
+    close(watch_fd_);
+    watch_fd_ = -1;
+    return;
+  }
+
+  watch_thread_ = std::thread([this] { Watch(); });
+  LOG_F(INFO, "Watch mailbox, dir={%s}", mailbox_.c_str());
+}
+
+void MailServer::Watch() {
+  alignas(inotify_event) char buffer[4096];
+
+  for (;;) {
+    const auto n = read(watch_fd_, buffer, sizeof(buffer));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      LOG_F(INFO, "Stop watching mailbox, dir={%s}", mailbox_.c_str());
+      return;
+    }
+
+    // Only a new or removed mbox or maildir changes the users, index and
+    // temporary files are ignored
+    bool reload = false;
+    for (char *p = buffer; p < buffer + n;) {
+      const auto *event = reinterpret_cast<const inotify_event *>(p);
+      if ((event->mask & IN_IGNORED) && event->wd == watch_wd_) {
+        LOG_F(INFO, "Stop watching mailbox, dir={%s}", mailbox_.c_str());
+        return;
+      }
+      if (event->len > 0 && event->name[0] != '.') {
+        const fs::path name(event->name);
+        reload = reload || (event->mask & IN_ISDIR) ||
+                 name.extension().string() == ".mbox";
+
+        // A new dir might become a maildir once tmp/, new/ and cur/ are
+        // created inside, so watch it as well
+        if (event->wd == watch_wd_ && (event->mask & IN_ISDIR) &&
+            (event->mask & IN_CREATE)) {
+          const auto dir = mailbox_ + "/" + event->name;
+          inotify_add_watch(watch_fd_, dir.c_str(), IN_CREATE | IN_ONLYDIR);
+        }
+      }
+      p += sizeof(inotify_event) + event->len;
+    }
+
+    if (reload) {
+      LOG_F(INFO, "Mailbox changed, reload users, dir={%s}", mailbox_.c_str());
+      LoadMailbox();
+    }
+  }
 }
 
 bool MailServer::UserExistsByMailaddr(const std::string &mailaddr) const {
@@ -56,23 +202,17 @@ bool MailServer::UserExistsByUsername(const std::string &username) const {
 }
 
 UserPtr MailServer::GetUserByMailaddr(const std::string &mailaddr) const {
-  auto pred = [&mailaddr](const auto &user) {
-    return user->mailaddr() == mailaddr;
-  };
-  auto user_iter = std::find_if(users_.begin(), users_.end(), pred);
-
-  if (user_iter != users_.end())
-    return *user_iter;
+  const auto table = users();
+  const auto user_iter = table->by_mailaddr.find(mailaddr);
+  if (user_iter != table->by_mailaddr.end())
+    return user_iter->second;
   return {nullptr};
 }
 
 UserPtr MailServer::GetUserByUsername(const std::string &username) const {
-  auto pred = [&username](const auto &user) {
-    return user->username() == username;
-  };
-  auto user_iter = std::find_if(users_.begin(), users_.end(), pred);
-
-  if (user_iter != users_.end())
-    return *user_iter;
+  const auto table = users();
+  const auto user_iter = table->by_username.find(username);
+  if (user_iter != table->by_username.end())
+    return user_iter->second;
   return {nullptr};
 }
@@ -6,6 +6,8 @@
 #define LOGURU_IMPLEMENTATION 1
 #include "loguru.hpp"
 
+#include "log.h"
+
 Pop3Server *pop3_server_ptr = nullptr;
 
 void SigintHandler(int sig) {
@@ -20,7 +22,7 @@ struct argp_args {
   bool print_name = false; // print name and seas login to stderr
   bool verbose = false;    // verbose mode,
   bool logstderr = false;  // log to stderr, otherwise log to file
-  int backlog = 10;        // backlog option to listen
+  ServerOptions server;    // -b -w -q -n
   const char *mailbox;     // directory of mailbox
 };
 
@@ -29,12 +31,16 @@ struct argp_option options[] = {
     {0, 'a', 0, 0, "Print name and seas login to stderr."},
     {0, 'v', 0, 0, "Verbose mode."},
     {0, 'l', 0, 0, "Log to stderr."},
-    {0, 'b', "BACKLOG", 0, "Number of connections on incoming queue."},
     {0}};
 
+struct argp_child children[] = {{&server_argp, 0, 0, 0}, {0}};
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   struct argp_args *args = (struct argp_args *)state->input;
   switch (key) {
+  case ARGP_KEY_INIT:
+    state->child_inputs[0] = &args->server;
+    break;
   case 'p':
     args->port_no = std::atoi(arg);
     break;
@@ -44,9 +50,6 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   case 'v':
     args->verbose = true;
     break;
-  case 'b':
-    args->backlog = std::atoi(arg);
-    break;
   case 'l':
     args->logstderr = true;
     break;
@@ -70,7 +73,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 argp_args ParseCmdArguments(int argc, char **argv) {
   // Parse command line arguments
   struct argp_args args;
-  struct argp argp_argp = {options, parse_opt, args_doc, 0};
+  struct argp argp_argp = {options, parse_opt, args_doc, 0, children};
   int status = argp_parse(&argp_argp, argc, argv, 0, 0, &args);
 
   if (status)
@@ -95,18 +98,21 @@ int main(int argc, char *argv[]) {
   // Setup log
   if (!args.logstderr) {
     loguru::g_stderr_verbosity = loguru::Verbosity_OFF;
-    loguru::add_file("pop3.log", loguru::Truncate, loguru::Verbosity_MAX);
+    AsyncLog::AddFile("pop3.log", loguru::Verbosity_MAX);
   }
 
   SetSigintHandler(SigintHandler);
 
   // EchoServer
-  Pop3Server pop3_server(args.port_no, args.backlog, args.verbose,
+  Pop3Server pop3_server(args.port_no, args.server.backlog, args.verbose,
                          args.mailbox);
   pop3_server_ptr = &pop3_server;
 
+  pop3_server.SetWorkers(args.server.workers, args.server.pending);
+  pop3_server.SetAcceptors(args.server.acceptors);
   pop3_server.Setup();
   pop3_server.LoadMailbox();
+  pop3_server.WatchMailbox();
   pop3_server.Run();
 
   return EXIT_SUCCESS;
@@ -1,50 +1,56 @@
 #include "pop3server.h"
+#include "connection.h"
+#include "fileio.h"
+#include "log.h"
 #include "lpi.h"
 #include "mail.h"
 #include "string_algorithms.h"
+#include "tablefsm.h"
 
-#include "fsm.hpp"
-#include "loguru.hpp"
+#include <ctype.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 #include <algorithm>
-#include <openssl/md5.h>
+#include <sstream>
+#include <thread>
+
+namespace {
+// Longest command line, with CRLF, RFC 2449 4
+constexpr size_t kMaxCommandLine = 255;
 
 enum class State { Init, User, Pass, Trans, Update };
 enum class Trigger { CONN_, USER, PASS_OK, PASS_ERR, QUIT, STAT };
-using Pop3Fsm = FSM::Fsm<State, State::Init, Trigger>; // State machine
-
-/**
- * @brief Convert MD5 hash to c++ string
- * @param hash a vector of unsigned char
- * @return string representation in hex
- */
-std::string StringFromHash(const std::vector<u_char> &hash) {
-  static const char *hex_digits = "0123456789ABCDEF";
-  std::string str;
-  str.reserve(MD5_DIGEST_LENGTH * 2);
-  for (size_t i = 0; i != MD5_DIGEST_LENGTH; ++i) {
-    str += hex_digits[hash[i] / MD5_DIGEST_LENGTH];
-    str += hex_digits[hash[i] % MD5_DIGEST_LENGTH];
-  }
-  return str;
-}
+enum class Action { None, Greet, ResetUser };
+constexpr size_t kNumStates = static_cast<size_t>(State::Update) + 1;
+constexpr size_t kNumTriggers = static_cast<size_t>(Trigger::STAT) + 1;
+using Pop3Fsm =
+    TableFsm<State, State::Init, kNumStates, Trigger, kNumTriggers, Action>;
+
+// from, to, trigger, action
+constexpr Pop3Fsm::Trans kTransitions[] = {
+    {State::Init, State::User, Trigger::CONN_, Action::Greet},
+    {State::User, State::Pass, Trigger::USER, Action::None},
+    {State::Pass, State::User, Trigger::PASS_ERR, Action::ResetUser},
+    {State::Pass, State::Trans, Trigger::PASS_OK, Action::None},
+    {State::Trans, State::Update, Trigger::QUIT, Action::None},
+};
+constexpr auto kTable = Pop3Fsm::MakeTable(kTransitions); // State machine
 
 /**
- * @brief Get unique id of a mail, which is just computing hash of its content
- * @param mail
- * @return unique id in string
+ * @brief Parse a message number without throwing, unlike std::stoi
+ * @return False if arg is not a number that fits in num
  */
-std::string UniqueId(const Mail &mail) {
-  const auto data = mail.Data();
-  std::vector<unsigned char> buffer(MD5_DIGEST_LENGTH);
-
-  MD5_CTX c;
-  MD5_Init(&c);
-  MD5_Update(&c, data.data(), data.length());
-  MD5_Final(buffer.data(), &c);
+bool ParseMsgNumber(const std::string &arg, size_t &num) {
+  if (arg.empty() || !isdigit(static_cast<unsigned char>(arg[0])))
+    return false;
 
-  return StringFromHash(buffer);
+  char *end = nullptr;
+  errno = 0;
+  num = std::strtoul(arg.c_str(), &end, 10);
+  return *end == '\0' && errno != ERANGE;
 }
+} // namespace
 
 Pop3Server::Pop3Server(int port_no, int backlog, bool verbose,
                        const std::string &mailbox)
@@ -54,59 +60,86 @@ void Pop3Server::Work(SocketPtr sock_ptr) {
   const auto fd = *sock_ptr;
   LOG_F(INFO, "[%d] Inside Pop3Server::Work", fd);
 
+  // Replies are queued and flushed once all pipelined commands are handled
+  Connection conn(fd, verbose_);
+  conn.set_max_line(kMaxCommandLine);
   Maildrop maildrop;
   UserPtr user;
+  std::unique_lock<std::mutex> maildrop_lock; // held in TRANSACTION state
 
   // Actions
-  auto greet = [&]() { WriteLine(fd, "+OK POP3 server ready"); };
-  auto reply_err = [&](const std::string &msg) { ReplyErr(fd, msg); };
-  auto reply_ok = [&](const std::string &msg) { ReplyOk(fd, msg); };
+  auto greet = [&]() { conn.WriteLine("+OK POP3 server ready"); };
+  auto reply_err = [&](const std::string &msg) { ReplyErr(conn, msg); };
+  auto reply_ok = [&](const std::string &msg) { ReplyOk(conn, msg); };
   auto reset_user = [&]() { user.reset(); };
 
-  Pop3Fsm fsm;
-  // from, to, trigger, guard, action
-  fsm.add_transitions({
-      {State::Init, State::User, Trigger::CONN_, nullptr, greet},
-      {State::User, State::Pass, Trigger::USER, nullptr, nullptr},
-      {State::Pass, State::User, Trigger::PASS_ERR, nullptr, reset_user},
-      {State::Pass, State::Trans, Trigger::PASS_OK, nullptr, nullptr},
-  });
+  // Run the action of a transition
+  auto act = [&](Action action) {
+    switch (action) {
+    case Action::None:
+      break;
+    case Action::Greet:
+      greet();
+      break;
+    case Action::ResetUser:
+      reset_user();
+      break;
+    }
+  };
+
+  Pop3Fsm fsm(kTable);
 
-  fsm.execute(Trigger::CONN_);
+  fsm.execute(Trigger::CONN_, act);
   CHECK_F(fsm.state() == State::User, "Init -- CONN/greet --> Auth");
 
-  while (true) {
-    std::string request;
-    ReadLine(fd, request);
+  std::string request;
+  bool quit = false;
+  while (!quit) {
+    // Blocks only when no pipelined command is left, queued replies are
+    // flushed right before that
+    if (!conn.ReadLine(request)) {
+      if (conn.line_too_long()) {
+        // The rest of the line is unread, there is no telling where the next
+        // command starts, so drop the client
+        ReplyErr(conn, "Line too long");
+        conn.Flush();
+      }
+      LOG_F(WARNING, "[%d] Client gone", fd);
+      break;
+    }
 
     // Extract command, for now assume no preceeding white spaces
-    const auto command = ExtractCommand(request);
-    LOG_F(INFO, "[%d] cmd={%s}", fd, command.c_str());
+    LOG_F(INFO, "[%d] cmd={%.4s}", fd, request.c_str());
 
-    if (command == "USER") { // ===== USER =====
+    switch (ExtractVerb(request)) {
+    case Verb("USER"): { // ===== USER =====
       if (fsm.state() != State::User) {
-        ReplyErr(fd, "USER only works in AUTORHIZATION");
+        reply_err("USER only works in AUTORHIZATION");
         continue;
       }
 
-      if (User(fd, user, request)) {
+      if (User(conn, user, request)) {
         CHECK_F(user.get() != nullptr, "User is null");
-        fsm.execute(Trigger::USER);
+        fsm.execute(Trigger::USER, act);
         CHECK_F(fsm.state() == State::Pass, "Auth_Name -- USER --> Auth_Pass");
       }
-    } else if (command == "PASS") { // ===== PASS =====
+      break;
+    }
+    case Verb("PASS"): { // ===== PASS =====
       if (fsm.state() != State::Pass) {
-        ReplyErr(fd, "PASS only works in AUTORHIZATION");
+        reply_err("PASS only works in AUTORHIZATION");
         continue;
       }
 
       // Check password
       const auto password = ExtractArgument(request);
       if (user->password() == password) {
-        if (user->mutex()->try_lock()) {
+        std::unique_lock<std::mutex> lock(*user->mutex(), std::try_to_lock);
+        if (lock.owns_lock()) {
+          maildrop_lock = std::move(lock);
           LOG_F(INFO, "[%d] lock acquired", fd);
 
-          fsm.execute(Trigger::PASS_OK);
+          fsm.execute(Trigger::PASS_OK, act);
 
           reply_ok("maildrop locked and ready");
           LOG_F(WARNING, "[%d] correct passwrod", fd);
@@ -119,7 +152,7 @@ void Pop3Server::Work(SocketPtr sock_ptr) {
                   "Auth_Pass -- PASS_OK --> Trans");
         } else {
           reply_err("unable to lock maildrop");
-          fsm.execute(Trigger::PASS_ERR);
+          fsm.execute(Trigger::PASS_ERR, act);
 
           LOG_F(WARNING, "[%d] Maildrop already locked", fd);
           CHECK_F(fsm.state() == State::User,
@@ -127,261 +160,384 @@ void Pop3Server::Work(SocketPtr sock_ptr) {
         }
       } else {
         reply_err("invalid password");
-        fsm.execute(Trigger::PASS_ERR);
+        fsm.execute(Trigger::PASS_ERR, act);
 
         LOG_F(WARNING, "[%d] Invalid password", fd);
         CHECK_F(fsm.state() == State::User,
                 "Auth_Pass -- PASS_ERR --> Auth_User");
       }
-    } else if (command == "STAT") { // ===== STAT =====
+      break;
+    }
+    case Verb("STAT"): { // ===== STAT =====
       if (fsm.state() != State::Trans) {
         reply_err("STAT only works in TRANSACTION");
         continue;
       }
 
-      Stat(fd, maildrop);
-    } else if (command == "RSET") { // ===== RSET =====
+      Stat(conn, maildrop);
+      break;
+    }
+    case Verb("RSET"): { // ===== RSET =====
       if (fsm.state() != State::Trans) {
         reply_err("STAT only works in TRANSACTION");
         continue;
       }
 
-      Rset(fd, maildrop);
-    } else if (command == "LIST") { // ===== LIST =====
+      Rset(conn, maildrop);
+      break;
+    }
+    case Verb("LIST"): { // ===== LIST =====
       if (fsm.state() != State::Trans) {
         reply_err("LIST only works in TRANSACTION");
         continue;
       }
 
-      CmdHandle handle = [&](int fd, const Maildrop &md, int arg) {
-        List(fd, md, arg);
+      CmdHandle handle = [&](Connection &conn, Maildrop &md, int arg) {
+        List(conn, md, arg);
       };
-      OptIntArgCmd(fd, maildrop, request, command, handle);
-    } else if (command == "RETR") { // ===== RETR =====
+      OptIntArgCmd(conn, maildrop, request, "LIST", handle);
+      break;
+    }
+    case Verb("RETR"): { // ===== RETR =====
       if (fsm.state() != State::Trans) {
         reply_err("RETR only works in TRANSACTION");
         continue;
       }
 
-      CmdHandle handle = [&](int fd, const Maildrop &md, int arg) {
-        Retr(fd, md, arg);
+      CmdHandle handle = [&](Connection &conn, Maildrop &md, int arg) {
+        Retr(conn, user, md, arg);
       };
-      IntArgCmd(fd, maildrop, request, command, handle);
-    } else if (command == "DELE") { // ===== DELE =====
+      IntArgCmd(conn, maildrop, request, "RETR", handle);
+      break;
+    }
+    case Verb("DELE"): { // ===== DELE =====
       if (fsm.state() != State::Trans) {
         reply_err("DELE only works in TRANSACTION");
         continue;
       }
 
-      CmdHandle handle = [&](int fd, const Maildrop &md, int arg) {
-        Dele(fd, md, arg);
+      CmdHandle handle = [&](Connection &conn, Maildrop &md, int arg) {
+        Dele(conn, md, arg);
       };
-      IntArgCmd(fd, maildrop, request, command, handle);
-    } else if (command == "NOOP") { // ===== NOOP =====
+      IntArgCmd(conn, maildrop, request, "DELE", handle);
+      break;
+    }
+    case Verb("NOOP"): { // ===== NOOP =====
       if (fsm.state() != State::Trans) {
         reply_err("NOOP only works in TRANSACTION");
         continue;
       }
 
-      ReplyOk(fd, "");
-    } else if (command == "UIDL") { // ===== UIDL =====
+      reply_ok("");
+      break;
+    }
+    case Verb("TOP"): { // ===== TOP =====
+      if (fsm.state() != State::Trans) {
+        reply_err("TOP only works in TRANSACTION");
+        continue;
+      }
+
+      Top(conn, user, maildrop, request);
+      break;
+    }
+    case Verb("CAPA"): { // ===== CAPA =====
+      Capa(conn);
+      break;
+    }
+    case Verb("UIDL"): { // ===== UIDL =====
       if (fsm.state() != State::Trans) {
         reply_err("UIDL only works in TRANSACTION");
         continue;
       }
 
-      CmdHandle handle = [&](int fd, const Maildrop &md, int arg) {
-        Uidl(fd, md, arg);
+      CmdHandle handle = [&](Connection &conn, Maildrop &md, int arg) {
+        Uidl(conn, md, arg);
       };
-      OptIntArgCmd(fd, maildrop, request, command, handle);
-    } else if (command == "QUIT") { // ===== QUIT =====
+      OptIntArgCmd(conn, maildrop, request, "UIDL", handle);
+      break;
+    }
+    case Verb("QUIT"): { // ===== QUIT =====
       if (fsm.state() == State::Trans) {
-        // Update maildrop
-        user->ClearMailbox();
-        for (const Mail &mail : maildrop.mails()) {
-          if (!mail.deleted()) {
-            user->WriteMail(mail);
-          }
-        }
-        LOG_F(INFO, "[%d] Update mailbox", fd);
+        fsm.execute(Trigger::QUIT, act);
+
+        // Update maildrop, only if something was deleted
+        bool compact = false;
+        const bool committed = user->CommitMaildrop(maildrop, compact);
+        LOG_F(INFO, "[%d] Update mailbox, ok={%d}", fd, committed);
 
         // Release lock
-        user->mutex()->unlock();
+        maildrop_lock.unlock();
         LOG_F(INFO, "[%d] lock released", fd);
 
-        reply_ok("POP3 server singing off");
+        // Compact in background, it takes the lock again
+        if (compact) {
+          std::thread compactor([user] {
+            std::lock_guard<std::mutex> guard(*(user->mutex()));
+            user->Compact();
+          });
+          compactor.detach();
+          LOG_F(INFO, "[%d] Compact mailbox in background", fd);
+        }
+
+        if (committed)
+          reply_ok("POP3 server singing off");
+        else
+          reply_err("some deleted messages not removed");
       } else if (fsm.state() == State::User || fsm.state() == State::Pass) {
         const auto msg = "POP3 server signing off";
         reply_ok(msg);
         LOG_F(INFO, "[%d] %s", fd, msg);
       }
-
-      // Close socket and mark it as closed
-      close(fd);
-      LOG_F(INFO, "[%d] Connection closed", fd);
-      if (verbose_)
-        fprintf(stderr, "[%d] Connection closed\n", fd);
-
-      // Set socket fd to -1
-      std::lock_guard<std::mutex> guard(sockets_mutex_);
-      *sock_ptr = -1;
-      return;
-    } else {
-      ReplyErr(fd, "Unknown command");
+      conn.Flush();
+      quit = true;
+      break;
     }
+    default:
+      reply_err("Unknown command");
+    }
+  }
+
+  // Client left without QUIT, nothing is deleted
+  if (maildrop_lock.owns_lock()) {
+    maildrop_lock.unlock();
+    LOG_F(INFO, "[%d] lock released", fd);
   }
+
+  // Close socket and mark it as closed
+  close(fd);
+  LOG_F(INFO, "[%d] Connection closed", fd);
+  if (verbose_)
+    fprintf(stderr, "[%d] Connection closed\n", fd);
+
+  // Set socket fd to -1
+  std::lock_guard<std::mutex> guard(sockets_mutex_);
+  *sock_ptr = -1;
+}
+
+void Pop3Server::ReplyOk(Connection &conn, const std::string &msg) const {
+  conn.WriteLine("+OK " + msg);
 }
 
-void Pop3Server::ReplyOk(int fd, const std::string &msg) const {
-  WriteLine(fd, "+OK " + msg);
+void Pop3Server::ReplyErr(Connection &conn, const std::string &msg) const {
+  conn.WriteLine("-ERR " + msg);
 }
 
-void Pop3Server::ReplyErr(int fd, const std::string &msg) const {
-  WriteLine(fd, "-ERR " + msg);
+void Pop3Server::Capa(Connection &conn) const {
+  ReplyOk(conn, "Capability list follows");
+  for (const auto *capa : {"USER", "UIDL", "TOP", "PIPELINING"})
+    conn.WriteLine(capa);
+  conn.WriteLine(".");
 }
 
-void Pop3Server::Stat(int fd, const Maildrop &md) const {
+void Pop3Server::Stat(Connection &conn, const Maildrop &md) const {
   const auto n = md.NumMails();
   const auto octets = md.TotalOctets();
   const auto msg = std::to_string(n) + " " + std::to_string(octets);
-  ReplyOk(fd, msg);
-  LOG_F(INFO, "[%d] STAT, n={%zu}, octets={%zu}", fd, n, octets);
+  ReplyOk(conn, msg);
+  LOG_F(INFO, "[%d] STAT, n={%zu}, octets={%zu}", conn.fd(), n, octets);
 }
 
-void Pop3Server::Rset(int fd, const Maildrop &md) const {
+void Pop3Server::Rset(Connection &conn, Maildrop &md) const {
   md.Reset();
   const auto n = md.NumMails();
   const auto octets = md.TotalOctets();
   const auto msg = std::to_string(n) + " " + std::to_string(octets);
-  ReplyOk(fd, msg);
-  LOG_F(INFO, "[%d] RSET, n={%zu}, octets={%zu}", fd, n, octets);
+  ReplyOk(conn, msg);
+  LOG_F(INFO, "[%d] RSET, n={%zu}, octets={%zu}", conn.fd(), n, octets);
 }
 
-void Pop3Server::List(int fd, const Maildrop &md, int arg) const {
+void Pop3Server::List(Connection &conn, const Maildrop &md, int arg) const {
   if (arg < 0) {
     const auto octets = md.TotalOctets();
     const auto n = md.NumMails(false);
     const auto n_all = md.NumMails(true);
 
-    ReplyOk(fd, std::to_string(n) + " messages (" + std::to_string(octets) +
-                    " octets)");
+    ReplyOk(conn, std::to_string(n) + " messages (" + std::to_string(octets) +
+                      " octets)");
 
     // Output stat for each mail
     for (size_t i = 0; i < n_all; ++i) {
-      const auto &mail = md.GetMail(i);
-      if (!mail.deleted()) {
-        WriteLine(fd,
-                  std::to_string(i + 1) + " " + std::to_string(mail.Octets()));
+      if (!md.IsDeleted(i)) {
+        conn.WriteLine(std::to_string(i + 1) + " " +
+                       std::to_string(md.GetEntry(i).octets));
       }
     }
-    WriteLine(fd, ".");
+    conn.WriteLine(".");
     return;
   }
 
-  const Mail &mail = md.GetMail(arg - 1);
-  if (!mail.deleted()) {
-    ReplyOk(fd, std::to_string(arg) + " " + std::to_string(mail.Octets()));
+  if (!md.IsDeleted(arg - 1)) {
+    ReplyOk(conn, std::to_string(arg) + " " +
+                      std::to_string(md.GetEntry(arg - 1).octets));
   } else {
     const auto arg_str = std::to_string(arg);
-    ReplyErr(fd, "message " + arg_str + " already deleted");
+    ReplyErr(conn, "message " + arg_str + " already deleted");
   }
 }
 
-void Pop3Server::Uidl(int fd, const Maildrop &md, int arg) const {
+void Pop3Server::Uidl(Connection &conn, const Maildrop &md, int arg) const {
 
   if (arg < 0) {
     const auto n_all = md.NumMails(true);
-    ReplyOk(fd, "");
+    ReplyOk(conn, "");
     // Output stat for each mail
     for (size_t i = 0; i < n_all; ++i) {
-      const auto &mail = md.GetMail(i);
-      if (!mail.deleted()) {
-        WriteLine(fd, std::to_string(i + 1) + " " + UniqueId(mail));
+      if (!md.IsDeleted(i)) {
+        conn.WriteLine(std::to_string(i + 1) + " " + md.GetEntry(i).uid);
       }
     }
-    WriteLine(fd, ".");
+    conn.WriteLine(".");
     return;
   }
 
-  const Mail &mail = md.GetMail(arg - 1);
-  if (!mail.deleted()) {
-    ReplyOk(fd, std::to_string(arg) + " " + UniqueId(mail));
+  if (!md.IsDeleted(arg - 1)) {
+    ReplyOk(conn, std::to_string(arg) + " " + md.GetEntry(arg - 1).uid);
   } else {
     const auto arg_str = std::to_string(arg);
-    ReplyErr(fd, "message " + arg_str + " already deleted");
+    ReplyErr(conn, "message " + arg_str + " already deleted");
   }
 }
 
-void Pop3Server::Retr(int fd, const Maildrop &md, int arg) const {
-  const Mail &mail = md.GetMail(arg - 1);
-  if (!mail.deleted()) {
-    ReplyOk(fd, std::to_string(mail.Octets()) + " octets");
-    Send(fd, mail);
+void Pop3Server::Retr(Connection &conn, const UserPtr &user, const Maildrop &md,
+                      int arg) const {
+  if (!md.IsDeleted(arg - 1)) {
+    const auto &entry = md.GetEntry(arg - 1);
+    ReplyOk(conn, std::to_string(entry.octets) + " octets");
+    // Mails stored in wire form go straight from file to socket, older ones
+    // are read and converted. Either way queued replies go out first
+    if (!conn.Flush())
+      return;
+    switch (user->SendMail(entry, conn.fd())) {
+    case SendStatus::Sent:
+      LOG_F(INFO, "[%d] Send mail, octets={%zu}", conn.fd(), entry.octets);
+      conn.WriteLine(".");
+      break;
+    case SendStatus::NotSupported:
+      Send(conn, user->ReadMail(entry));
+      break;
+    case SendStatus::Failed:
+      // Part of the mail may be out already, sending it again would corrupt
+      // the reply, so drop the client. The next read fails and ends the
+      // session without committing
+      LOG_F(ERROR, "[%d] Failed to send mail, octets={%zu}", conn.fd(),
+            entry.octets);
+      shutdown(conn.fd(), SHUT_RDWR);
+      break;
+    }
   } else {
     const auto arg_str = std::to_string(arg);
-    ReplyErr(fd, "message " + arg_str + " already deleted");
+    ReplyErr(conn, "message " + arg_str + " already deleted");
   }
 }
 
-void Pop3Server::Dele(int fd, const Maildrop &md, int arg) const {
+void Pop3Server::Top(Connection &conn, const UserPtr &user, const Maildrop &md,
+                     const std::string &req) const {
+  // TOP msg n, both arguments are required
+  std::istringstream args(ExtractArgument(req, 3));
+  long msg = 0;
+  long n = 0;
+  if (!(args >> msg >> n) || n < 0) {
+    ReplyErr(conn, "TOP needs a message number and a line count");
+    return;
+  }
+
+  LOG_F(INFO, "[%d] TOP %ld %ld", conn.fd(), msg, n);
+  const auto n_all = md.NumMails(true);
+  if (msg <= 0 || static_cast<size_t>(msg) > n_all) {
+    ReplyErr(conn, std::to_string(md.NumMails(false)) + "/" +
+                       std::to_string(n_all) + " messages");
+    return;
+  }
+
+  if (md.IsDeleted(msg - 1)) {
+    ReplyErr(conn, "message " + std::to_string(msg) + " already deleted");
+    return;
+  }
+
+  // Only the header and n lines are read from the mailbox
+  const auto mail = user->ReadTop(md.GetEntry(msg - 1), n);
+  ReplyOk(conn, "top of message follows");
+  if (conn.Flush())
+    Send(conn, mail);
+}
+
+void Pop3Server::Dele(Connection &conn, Maildrop &md, int arg) const {
   const auto arg_str = std::to_string(arg);
-  const Mail &mail = md.GetMail(arg - 1);
-  if (!mail.deleted()) {
-    ReplyOk(fd, "message " + arg_str + " deleted");
-    mail.MarkDeleted();
+  if (!md.IsDeleted(arg - 1)) {
+    ReplyOk(conn, "message " + arg_str + " deleted");
+    md.MarkDeleted(arg - 1);
   } else {
-    ReplyErr(fd, "message " + arg_str + " already deleted");
+    ReplyErr(conn, "message " + arg_str + " already deleted");
   }
 }
 
-bool Pop3Server::User(int fd, UserPtr &user, const std::string &req) const {
+bool Pop3Server::User(Connection &conn, UserPtr &user,
+                      const std::string &req) const {
   const auto username = ExtractArgument(req);
   user = GetUserByUsername(username);
 
   if (!user) {
-    ReplyErr(fd, "No mailbox here for " + username);
+    ReplyErr(conn, "No mailbox here for " + username);
     LOG_F(WARNING, "No mailbox here for, user={%s}", username.c_str());
     return false;
   }
 
-  ReplyOk(fd, username + " is a valid mailbox");
+  ReplyOk(conn, username + " is a valid mailbox");
   LOG_F(WARNING, "Found valid mailbox, user={%s}", username.c_str());
   return true;
 }
 
-void Pop3Server::Send(int fd, const Mail &mail) const {
-  for (const auto &line : mail.lines()) {
-    WriteLine(fd, line);
+void Pop3Server::Send(Connection &conn, const Mail &mail) const {
+  // Body is already in CRLF form, send it as it is, after queued replies
+  const auto fd = conn.fd();
+  const auto &body = mail.body();
+  if (!WriteAll(fd, body.data(), body.size())) {
+    LOG_F(WARNING, "[%d] Write failed", fd);
+    return;
   }
-  WriteLine(fd, ".");
+
+  LOG_F(INFO, "[%d] Write mail, octets={%zu}", fd, body.size());
+  if (verbose_) {
+    for (size_t i = 0; i < mail.NumLines(); ++i) {
+      fprintf(stderr, "[%d] S: %.*s\n", fd, static_cast<int>(mail.LineSize(i)),
+              mail.LineData(i));
+    }
+  }
+  conn.WriteLine(".");
 }
 
-void Pop3Server::IntArgCmd(int fd, const Maildrop &md, const std::string &req,
-                           const std::string &cmd, CmdHandle &handle) const {
+void Pop3Server::IntArgCmd(Connection &conn, Maildrop &md,
+                           const std::string &req, const char *cmd,
+                           CmdHandle &handle) const {
   const auto n = md.NumMails(false);
   const auto n_all = md.NumMails(true);
   auto arg = ExtractArgument(req);
   trim(arg);
 
   if (arg.empty()) {
-    ReplyErr(fd, cmd + " needs one argument");
+    ReplyErr(conn, std::string(cmd) + " needs one argument");
     return;
   }
 
-  LOG_F(INFO, "[%d] %s %s", fd, cmd.c_str(), arg.c_str());
+  LOG_F(INFO, "[%d] %s %s", conn.fd(), cmd, arg.c_str());
 
-  const size_t i = std::stoi(arg);
-  if (i > n_all || i <= 0) {
-    ReplyErr(fd, std::to_string(n) + "/" + std::to_string(n_all) + " messages");
+  size_t i = 0;
+  if (!ParseMsgNumber(arg, i)) {
+    ReplyErr(conn, "invalid message number " + arg);
+    return;
+  }
+  if (i > n_all || i == 0) {
+    ReplyErr(conn,
+             std::to_string(n) + "/" + std::to_string(n_all) + " messages");
     return;
   }
 
   // Do work with single arg
-  handle(fd, md, i);
+  handle(conn, md, i);
 }
 
-void Pop3Server::OptIntArgCmd(int fd, const Maildrop &md,
-                              const std::string &req, const std::string &cmd,
+void Pop3Server::OptIntArgCmd(Connection &conn, Maildrop &md,
+                              const std::string &req, const char *cmd,
                               CmdHandle &handle) const {
   auto arg = ExtractArgument(req);
   trim(arg);
@@ -390,20 +546,25 @@ void Pop3Server::OptIntArgCmd(int fd, const Maildrop &md,
   const auto n_all = md.NumMails(true);
 
   if (arg.empty()) {
-    LOG_F(INFO, "[%d] %s no arg", fd, cmd.c_str());
+    LOG_F(INFO, "[%d] %s no arg", conn.fd(), cmd);
 
     // Do work with out arg
-    handle(fd, md, -1);
+    handle(conn, md, -1);
     return;
   }
 
-  LOG_F(INFO, "[%d] %s %s", fd, cmd.c_str(), arg.c_str());
-  const size_t i = std::stoi(arg);
-  if (i > n_all || i <= 0) {
-    ReplyErr(fd, std::to_string(n) + "/" + std::to_string(n_all) + " messages");
+  LOG_F(INFO, "[%d] %s %s", conn.fd(), cmd, arg.c_str());
+  size_t i = 0;
+  if (!ParseMsgNumber(arg, i)) {
+    ReplyErr(conn, "invalid message number " + arg);
+    return;
+  }
+  if (i > n_all || i == 0) {
+    ReplyErr(conn,
+             std::to_string(n) + "/" + std::to_string(n_all) + " messages");
     return;
   }
 
   // Do work with single arg
-  handle(fd, md, i);
+  handle(conn, md, i);
 }
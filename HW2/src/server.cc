@@ -1,16 +1,22 @@
 #include "server.h"
-#include "loguru.hpp"
+#include "log.h"
 #include "lpi.h"
 #include "string_algorithms.h"
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <sys/signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
 #include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <exception>
 #include <stdarg.h>
 #include <thread>
 
@@ -31,6 +37,25 @@ std::string ExtractArgument(const std::string &request, size_t len) {
   return request.substr(len + 1);
 }
 
+uint32_t ExtractVerb(const std::string &request) {
+  // First four bytes, padded with spaces
+  unsigned char bytes[4] = {' ', ' ', ' ', ' '};
+  memcpy(bytes, request.data(), std::min<size_t>(request.size(), 4));
+  const uint32_t word = bytes[0] | bytes[1] << 8 | bytes[2] << 16 |
+                        static_cast<uint32_t>(bytes[3]) << 24;
+
+  // Verbs are ASCII letters
+  if ((word & 0x80808080) != 0)
+    return 0;
+  // A four letter verb has to be the whole first word
+  if (bytes[3] != ' ' && request.size() > 4 && !isspace(request[4]))
+    return 0;
+
+  // Clearing bit 5 upper cases letters, and turns the space after a three
+  // letter verb into 0
+  return word & 0xDFDFDFDF;
+}
+
 void Server::RemoveClosedSockets() {
   std::lock_guard<std::mutex> guard(sockets_mutex_);
   auto is_socket_closed = [](const auto &fd) { return *fd < 0; };
@@ -119,6 +144,27 @@ bool Server::ReadLine(int fd, std::string &line) const {
   return true;
 }
 
+namespace {
+/**
+ * @brief Keep the calling thread on one core, acceptor i goes to core i
+ */
+void PinToCore(size_t index) {
+  const unsigned num_cores = std::thread::hardware_concurrency();
+  if (num_cores == 0)
+    return;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(index % num_cores, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+    LOG_F(WARNING, "Failed to pin acceptor, index={%zu}", index);
+    return;
+  }
+  LOG_F(INFO, "Pin acceptor, index={%zu}, core={%zu}", index,
+        index % num_cores);
+}
+} // namespace
+
 void SetSigintHandler(sa_handler_ptr handler) {
   // Setup SIGINT handler
   struct sigaction sa;
@@ -134,44 +180,101 @@ void SetSigintHandler(sa_handler_ptr handler) {
   LOG_F(INFO, "Set SIGINT handler");
 }
 
+namespace {
+
+struct argp_option server_options[] = {
+    {0, 'b', "BACKLOG", 0, "Number of connections on incoming queue."},
+    {0, 'w', "WORKERS", 0, "Number of worker threads, default is 64."},
+    {0, 'q', "PENDING", 0,
+     "Number of connections waiting for a worker, default is 64."},
+    {0, 'n', "ACCEPTORS", 0,
+     "Number of threads accepting connections, each with its own listen "
+     "socket, default is 1."},
+    {0}};
+
+// Parse a count option, -1 if arg is not a number or is negative
+int ParseCount(const char *arg) {
+  char *end = nullptr;
+  const long value = std::strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || value < 0 || value > INT_MAX)
+    return -1;
+  return static_cast<int>(value);
+}
+
+error_t ParseServerOption(int key, char *arg, struct argp_state *state) {
+  auto *options = static_cast<ServerOptions *>(state->input);
+  switch (key) {
+  case 'b':
+    options->backlog = ParseCount(arg);
+    if (options->backlog <= 0)
+      argp_error(state, "BACKLOG must be a positive number, got %s", arg);
+    break;
+  case 'w':
+    options->workers = ParseCount(arg);
+    if (options->workers <= 0)
+      argp_error(state, "WORKERS must be a positive number, got %s", arg);
+    break;
+  case 'q':
+    // 0 is allowed, connections are then turned away once all workers are
+    // busy
+    options->pending = ParseCount(arg);
+    if (options->pending < 0)
+      argp_error(state, "PENDING must be 0 or a positive number, got %s", arg);
+    break;
+  case 'n':
+    options->acceptors = ParseCount(arg);
+    if (options->acceptors <= 0)
+      argp_error(state, "ACCEPTORS must be a positive number, got %s", arg);
+    break;
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+} // namespace
+
+const struct argp server_argp = {server_options, ParseServerOption, 0, 0};
+
 Server::Server(int port_no, int backlog, bool verbose)
     : port_no_(port_no), backlog_(backlog), verbose_(verbose) {
   LOG_F(INFO, "port_no={%d}", port_no_);
   LOG_F(INFO, "backlog={%d}", backlog_);
 }
 
-void Server::CreateSocket() {
+int Server::CreateSocket() {
   // Create listen socket
-  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-  if (listen_fd_ == -1) {
+  const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd == -1) {
     const auto msg = "Failed to create listen socket";
     LOG_F(ERROR, msg);
     errExit(msg);
   }
 
-  LOG_F(INFO, "Create listen socket, fd={%d}", listen_fd_);
+  LOG_F(INFO, "Create listen socket, fd={%d}", listen_fd);
+  return listen_fd;
 }
 
-void Server::ReuseAddrPort() {
+void Server::ReuseAddrPort(int listen_fd) {
   // Reuse address
   const int val = 1;
   constexpr auto int_size = sizeof(int);
-  if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &val, int_size) < 0) {
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &val, int_size) < 0) {
     const auto msg = "Failed to set socket option SO_REUSEADDR";
     LOG_F(WARNING, msg);
   } else {
-    LOG_F(INFO, "Set socket opt to reuse address, fd={%d}", listen_fd_);
+    LOG_F(INFO, "Set socket opt to reuse address, fd={%d}", listen_fd);
   }
 
-  if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &val, int_size) < 0) {
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &val, int_size) < 0) {
     const auto msg = "Failed to set socket option SO_REUSEPORT";
     LOG_F(WARNING, msg);
   } else {
-    LOG_F(INFO, "Set socket opt to reuse port, fd={%d}", listen_fd_);
+    LOG_F(INFO, "Set socket opt to reuse port, fd={%d}", listen_fd);
   }
 }
 
-void Server::BindAddress() {
+void Server::BindAddress(int listen_fd) {
   // Prepare sockaddr
   sockaddr_in server_addr;
   bzero(&server_addr, sizeof(server_addr));
@@ -180,7 +283,7 @@ void Server::BindAddress() {
   server_addr.sin_port = htons(port_no_);
 
   // Bind to an address
-  int ret = bind(listen_fd_, (sockaddr *)&server_addr, sizeof(server_addr));
+  int ret = bind(listen_fd, (sockaddr *)&server_addr, sizeof(server_addr));
   if (ret == -1) {
     const auto msg = "Failed to bind listen socket";
     LOG_F(ERROR, msg);
@@ -191,9 +294,9 @@ void Server::BindAddress() {
         static_cast<int>(server_addr.sin_port));
 }
 
-void Server::ListenSocket() {
+void Server::ListenSocket(int listen_fd) {
   // Listen to incoming connection
-  if (listen(listen_fd_, backlog_) == -1) {
+  if (listen(listen_fd, backlog_) == -1) {
     const auto msg = "Failed to listen to connections";
     LOG_F(FATAL, msg);
     errExit(msg);
@@ -202,23 +305,64 @@ void Server::ListenSocket() {
   LOG_F(INFO, "Start listening to connections");
 }
 
+void Server::SetAcceptors(size_t num_acceptors) {
+  num_acceptors_ = std::max<size_t>(num_acceptors, 1);
+  LOG_F(INFO, "num_acceptors={%zu}", num_acceptors_);
+}
+
 void Server::Setup() {
-  CreateSocket();
-  ReuseAddrPort();
-  BindAddress();
-  ListenSocket();
+  // Every acceptor binds its own socket to the port, SO_REUSEPORT lets the
+  // kernel spread incoming connections over them
+  for (size_t i = 0; i < num_acceptors_; ++i) {
+    const int listen_fd = CreateSocket();
+    ReuseAddrPort(listen_fd);
+    BindAddress(listen_fd);
+    ListenSocket(listen_fd);
+    listen_fds_.push_back(listen_fd);
+  }
+}
+
+void Server::SetWorkers(size_t num_workers, size_t max_pending) {
+  num_workers_ = std::max<size_t>(num_workers, 1);
+  max_pending_ = max_pending;
+  LOG_F(INFO, "num_workers={%zu}, max_pending={%zu}", num_workers_,
+        max_pending_);
+}
+
+std::string Server::OverloadReply() const {
+  return "-ERR Server busy, try again later";
 }
 
 void Server::Run() {
+  // One pool for all acceptors, whichever one the kernel hands a connection
+  // to it goes to the next free worker. Created before any acceptor is
+  // pinned, so workers are free to run on any core
+  workers_.reset(new ThreadPool(num_workers_));
+
+  const size_t n = listen_fds_.size();
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n; ++i)
+    threads.emplace_back([this, i] { Accept(i); });
+  Accept(0);
+
+  for (auto &thread : threads)
+    thread.join();
+}
+
+void Server::Accept(size_t index) {
+  const int listen_fd = listen_fds_[index];
+  if (listen_fds_.size() > 1)
+    PinToCore(index);
+
   sockaddr_in client_addr;
   socklen_t sin_size = sizeof(client_addr);
   char client_ip[INET_ADDRSTRLEN];
 
   while (true) {
     // Accept connection
-    int connect_fd = accept(listen_fd_, (sockaddr *)&client_addr, &sin_size);
+    int connect_fd = accept(listen_fd, (sockaddr *)&client_addr, &sin_size);
     if (connect_fd == -1) {
-      LOG_F(WARNING, "Accept failed, fd={%d}, port_h={%d}", listen_fd_,
+      LOG_F(WARNING, "Accept failed, fd={%d}, port_h={%d}", listen_fd,
             port_no_);
       continue;
     }
@@ -229,12 +373,44 @@ void Server::Run() {
     if (verbose_)
       fprintf(stderr, "[%d] New connection\n", connect_fd);
 
+    // Every worker is busy and the queue is full, shed the connection right
+    // away rather than keep the client waiting
+    if (!Admit()) {
+      LOG_F(WARNING, "Server overloaded, fd={%d}, num_conn={%zu}", connect_fd,
+            num_admitted_.load());
+      WriteLine(connect_fd, OverloadReply());
+      close(connect_fd);
+      continue;
+    }
+
     auto connect_fd_ptr = std::make_shared<int>(connect_fd);
-    sockets_.push_back(connect_fd_ptr);
+    {
+      std::lock_guard<std::mutex> guard(sockets_mutex_);
+      sockets_.push_back(connect_fd_ptr);
+    }
 
-    // Create a thread to handle connection and detach
-    std::thread worker([&] { Work(connect_fd_ptr); });
-    worker.detach();
+    // Queue connection for the next free worker, the socket is captured by
+    // value since the next accept() replaces it
+    workers_->Submit([this, connect_fd_ptr] {
+      // Give the slot back however Work ends
+      struct Release {
+        std::atomic<size_t> &num_admitted;
+        ~Release() { --num_admitted; }
+      } release{num_admitted_};
+
+      // Nobody reads the future, an exception left in it would leave the
+      // client hanging and its socket open
+      try {
+        Work(connect_fd_ptr);
+      } catch (const std::exception &e) {
+        LOG_F(ERROR, "Worker failed, fd={%d}, what={%s}", *connect_fd_ptr,
+              e.what());
+        CloseSocket(connect_fd_ptr);
+      } catch (...) {
+        LOG_F(ERROR, "Worker failed, fd={%d}", *connect_fd_ptr);
+        CloseSocket(connect_fd_ptr);
+      }
+    });
 
     // Clean closed sockets
     RemoveClosedSockets();
@@ -242,10 +418,32 @@ void Server::Run() {
   }
 }
 
+bool Server::Admit() {
+  const size_t max_admitted = num_workers_ + max_pending_;
+  size_t num_admitted = num_admitted_.load();
+  do {
+    if (num_admitted >= max_admitted)
+      return false;
+  } while (!num_admitted_.compare_exchange_weak(num_admitted,
+                                                num_admitted + 1));
+  return true;
+}
+
+void Server::CloseSocket(const SocketPtr &sock_ptr) {
+  std::lock_guard<std::mutex> guard(sockets_mutex_);
+  if (*sock_ptr < 0)
+    return;
+  close(*sock_ptr);
+  LOG_F(INFO, "Close client socket, fd={%d}", *sock_ptr);
+  *sock_ptr = -1;
+}
+
 void Server::Stop() {
-  // Close listen socket
-  close(listen_fd_);
-  LOG_F(INFO, "Close listen socket, fd={%d}, sig={SIGINT}", listen_fd_);
+  // Close listen sockets
+  for (const int listen_fd : listen_fds_) {
+    close(listen_fd);
+    LOG_F(INFO, "Close listen socket, fd={%d}, sig={SIGINT}", listen_fd);
+  }
 
   LOG_F(INFO, "Open sockets, num_fd={%zu}", sockets_.size());
   RemoveClosedSockets();
@@ -0,0 +1,89 @@
+#include "smtpparser.h"
+
+#include <string.h>
+
+namespace {
+
+inline bool IsAlnum(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9');
+}
+
+inline char ToUpper(char c) { return (c >= 'a' && c <= 'z') ? c - 32 : c; }
+
+/**
+ * @brief atext of RFC 5322
+ */
+inline bool IsAtext(char c) {
+  return IsAlnum(c) || (c != '\0' && strchr("!#$%&'*+-/=?^_`{|}~", c));
+}
+
+/**
+ * @brief Check dot separated atoms, no empty atom allowed
+ * @param is_char, chars allowed in an atom
+ */
+template <typename Pred>
+bool IsDotted(const char *begin, const char *end, Pred is_char) {
+  if (begin == end)
+    return false;
+
+  bool atom_empty = true;
+  for (const char *p = begin; p != end; ++p) {
+    if (*p == '.') {
+      if (atom_empty)
+        return false;
+      atom_empty = true;
+    } else if (is_char(*p)) {
+      atom_empty = false;
+    } else {
+      return false;
+    }
+  }
+  return !atom_empty;
+}
+
+} // namespace
+
+bool IsMailaddr(const char *begin, const char *end) {
+  const char *at = static_cast<const char *>(memchr(begin, '@', end - begin));
+  if (at == nullptr)
+    return false;
+
+  auto is_label_char = [](char c) { return IsAlnum(c) || c == '-'; };
+  return IsDotted(begin, at, IsAtext) && IsDotted(at + 1, end, is_label_char);
+}
+
+bool ParsePath(const std::string &request, const char *prefix,
+               std::string &mailaddr, bool allow_empty) {
+  const char *p = request.data();
+  const char *end = p + request.size();
+
+  // Prefix, ignoring case
+  for (; *prefix != '\0'; ++prefix, ++p) {
+    if (p == end || ToUpper(*p) != ToUpper(*prefix))
+      return false;
+  }
+
+  // Optional spaces
+  while (p != end && *p == ' ')
+    ++p;
+
+  // <mailaddr>, anything after > are parameters and ignored
+  if (p == end || *p != '<')
+    return false;
+  const char *addr_begin = ++p;
+  const char *addr_end =
+      static_cast<const char *>(memchr(addr_begin, '>', end - addr_begin));
+  if (addr_end == nullptr)
+    return false;
+
+  if (addr_begin == addr_end) {
+    if (!allow_empty)
+      return false;
+  } else if (!IsMailaddr(addr_begin, addr_end)) {
+    return false;
+  }
+
+  mailaddr.assign(addr_begin, addr_end);
+  return true;
+}
@@ -1,94 +1,189 @@
 #include "smtpserver.h"
+#include "connection.h"
+#include "log.h"
 #include "lpi.h"
 #include "mail.h"
+#include "smtpparser.h"
+#include "spool.h"
 #include "string_algorithms.h"
-
-#include "fsm.hpp"
-#include "loguru.hpp"
+#include "tablefsm.h"
 
 #include <algorithm>
 
-enum class State { Init, Wait, Mail, Rcpt, Data, Send };
-enum class Trigger { HELO, MAIL, RCPT, RSET, QUIT, DATA, CONN_, EOML_, SENT_ };
-using SmtpFsm = FSM::Fsm<State, State::Init, Trigger>; // State machine
+namespace {
+// Longest lines, with CRLF, RFC 5321 4.5.3.1
+constexpr size_t kMaxCommandLine = 512;
+constexpr size_t kMaxTextLine = 1000;
 
-void SmtpServer::ReplyCode(int fd, int code) const {
+enum class State { Init, Wait, Mail, Rcpt, Data, Send };
+enum class Trigger {
+  HELO,
+  EHLO,
+  MAIL,
+  RCPT,
+  RSET,
+  QUIT,
+  DATA,
+  CONN_,
+  EOML_,
+  SENT_,
+  FAIL_
+};
+enum class Action { None, Greet, Ok, OkHelo, OkEhlo, OkReset, OkData, ErrData };
+constexpr size_t kNumStates = static_cast<size_t>(State::Send) + 1;
+constexpr size_t kNumTriggers = static_cast<size_t>(Trigger::FAIL_) + 1;
+using SmtpFsm =
+    TableFsm<State, State::Init, kNumStates, Trigger, kNumTriggers, Action>;
+
+// from, to, trigger, action
+constexpr SmtpFsm::Trans kTransitions[] = {
+    // On connection
+    {State::Init, State::Wait, Trigger::CONN_, Action::Greet},
+    // Flow
+    {State::Wait, State::Wait, Trigger::HELO, Action::OkHelo},
+    {State::Wait, State::Wait, Trigger::EHLO, Action::OkEhlo},
+    {State::Wait, State::Mail, Trigger::MAIL, Action::Ok},
+    {State::Mail, State::Rcpt, Trigger::RCPT, Action::Ok},
+    {State::Rcpt, State::Rcpt, Trigger::RCPT, Action::Ok},
+    {State::Rcpt, State::Data, Trigger::DATA, Action::OkData},
+    {State::Data, State::Wait, Trigger::EOML_, Action::OkReset},
+    {State::Data, State::Wait, Trigger::FAIL_, Action::ErrData},
+    // Reset
+    {State::Mail, State::Wait, Trigger::RSET, Action::OkReset},
+    {State::Rcpt, State::Wait, Trigger::RSET, Action::OkReset},
+    {State::Wait, State::Wait, Trigger::RSET, Action::OkReset},
+};
+constexpr auto kTable = SmtpFsm::MakeTable(kTransitions); // State machine
+} // namespace
+
+void SmtpServer::ReplyCode(Connection &conn, int code) const {
   if (code == 503) {
     const auto reply = "503 Bad sequence of commands";
-    WriteLine(fd, reply);
+    conn.WriteLine(reply);
   } else if (code == 501) {
     const auto reply = "501 Syntax error in parameters or arguments";
-    WriteLine(fd, reply);
+    conn.WriteLine(reply);
   } else {
-    LOG_F(WARNING, "[%d] Unknown code, code={%d}", fd, code);
+    LOG_F(WARNING, "[%d] Unknown code, code={%d}", conn.fd(), code);
   }
 }
 
+std::string SmtpServer::OverloadReply() const {
+  return "421 Service not available, closing transmission channel";
+}
+
 SmtpServer::SmtpServer(int port_no, int backlog, bool verbose,
                        const std::string &mailbox)
-    : MailServer(port_no, backlog, verbose, mailbox) {
-  // TODO: Need to fix this pattern
-  std::string mailaddr_pattern("[[:alnum:]]+[[:alnum:].]*");
-  mailaddr_pattern = mailaddr_pattern + "@" + mailaddr_pattern;
-
-  std::string mail_from_pattern = "MAIL FROM:[ ]*<(" + mailaddr_pattern + ")>";
-  mailfrom_regex_ = std::regex(mail_from_pattern, std::regex::icase);
-
-  std::string rcpt_to_pattern = "RCPT TO:[ ]*<(" + mailaddr_pattern + ")>";
-  rcptto_regex_ = std::regex(rcpt_to_pattern, std::regex::icase);
-}
+    : MailServer(port_no, backlog, verbose, mailbox),
+      group_commit_(std::chrono::milliseconds(2), 1 << 20),
+      // Deliveries mostly wait for the disk, so more threads than cores
+      delivery_pool_(std::max(8u, 2 * std::thread::hardware_concurrency())),
+      queue_(mailbox + "/.queue", delivery_pool_,
+             [this](const Mail &mail, const Spool &spool,
+                    const std::string &recipient) {
+               return Deliver(mail, spool, recipient);
+             }) {}
 
 void SmtpServer::Work(SocketPtr sock_ptr) {
   const auto fd = *sock_ptr;
   LOG_F(INFO, "[%d] Inside SmtpServer::Work", fd);
 
+  // Replies are queued and flushed once all pipelined commands are handled
+  Connection conn(fd, verbose_);
   Mail mail;
+  Spool spool(spool_dir()); // mail content goes to disk, not memory
+  bool spool_ok = true;
   // Actions
-  auto greet = [&]() { WriteLine(fd, "220 localhost service ready"); };
-  auto ok = [&]() { WriteLine(fd, "250 OK"); };
-  auto ok_helo = [&]() { WriteLine(fd, "250 localhost"); };
+  auto greet = [&]() { conn.WriteLine("220 localhost service ready"); };
+  auto ok = [&]() { conn.WriteLine("250 OK"); };
+  auto ok_helo = [&]() { conn.WriteLine("250 localhost"); };
+  auto ok_ehlo = [&]() {
+    conn.WriteLine("250-localhost");
+    conn.WriteLine("250 PIPELINING");
+  };
   auto reset = [&]() { mail.Clear(); };
   auto ok_reset = [&]() {
     reset();
     ok();
   };
-  auto ok_data = [&]() { WriteLine(fd, "354 Start mail input"); };
-
-  SmtpFsm fsm;
-  // from, to, trigger, guard, action
-  fsm.add_transitions({
-      // On connection
-      {State::Init, State::Wait, Trigger::CONN_, nullptr, greet},
-      // Flow
-      {State::Wait, State::Wait, Trigger::HELO, nullptr, ok_helo},
-      {State::Wait, State::Mail, Trigger::MAIL, nullptr, ok},
-      {State::Mail, State::Rcpt, Trigger::RCPT, nullptr, ok},
-      {State::Rcpt, State::Rcpt, Trigger::RCPT, nullptr, ok},
-      {State::Rcpt, State::Data, Trigger::DATA, nullptr, ok_data},
-      {State::Data, State::Wait, Trigger::EOML_, nullptr, ok_reset},
-      // Reset
-      {State::Mail, State::Wait, Trigger::RSET, nullptr, ok_reset},
-      {State::Rcpt, State::Wait, Trigger::RSET, nullptr, ok_reset},
-      {State::Wait, State::Wait, Trigger::RSET, nullptr, ok_reset},
-  });
+  auto ok_data = [&]() { conn.WriteLine("354 Start mail input"); };
+  auto err_data = [&]() {
+    reset();
+    conn.WriteLine("451 Requested action aborted: local error in processing");
+  };
+
+  // Run the action of a transition
+  auto act = [&](Action action) {
+    switch (action) {
+    case Action::None:
+      break;
+    case Action::Greet:
+      greet();
+      break;
+    case Action::Ok:
+      ok();
+      break;
+    case Action::OkHelo:
+      ok_helo();
+      break;
+    case Action::OkEhlo:
+      ok_ehlo();
+      break;
+    case Action::OkReset:
+      ok_reset();
+      break;
+    case Action::OkData:
+      ok_data();
+      break;
+    case Action::ErrData:
+      err_data();
+      break;
+    }
+  };
+
+  SmtpFsm fsm(kTable);
 
   // On connection
-  fsm.execute(Trigger::CONN_);
+  fsm.execute(Trigger::CONN_, act);
   CHECK_F(fsm.state() == State::Wait, "Init -- CONN/greet --> Wait");
 
   // State machine here
-  while (true) {
-    std::string request;
-    ReadLine(fd, request);
+  std::string request;
+  bool quit = false;
+  while (!quit) {
+    conn.set_max_line(fsm.state() == State::Data ? kMaxTextLine
+                                                 : kMaxCommandLine);
+
+    // Blocks only when no pipelined command is left, queued replies are
+    // flushed right before that
+    if (!conn.ReadLine(request)) {
+      if (conn.line_too_long()) {
+        // The rest of the line is unread, there is no telling where the next
+        // command starts, so drop the client
+        conn.WriteLine("500 Line too long");
+        conn.Flush();
+      }
+      LOG_F(WARNING, "[%d] Client gone", fd);
+      break;
+    }
 
     // Text state
     if (fsm.state() == State::Data) {
       if (request == ".") {
         // ===== End of mail =====
-        mail.Stamp();       // Time stamp mail
-        SendMail(mail, fd); // Send mail
-
-        fsm.execute(Trigger::EOML_);
+        spool_ok = spool_ok && spool.Finish();
+        if (spool_ok) {
+          mail.Stamp(); // Time stamp mail
+          spool_ok = SendMail(mail, spool, fd);
+        }
+        if (spool_ok) {
+          fsm.execute(Trigger::EOML_, act);
+        } else {
+          LOG_F(ERROR, "[%d] Spool failed, mail dropped", fd);
+          fsm.execute(Trigger::FAIL_, act);
+        }
+        spool.Clear();
+        spool_ok = true;
 
         const auto msg = "State transition: Data -- ./ok --> Wait";
         CHECK_F(fsm.state() == State::Wait);
@@ -96,91 +191,96 @@ void SmtpServer::Work(SocketPtr sock_ptr) {
         continue;
       }
 
-      mail.AddLine(request);
+      // Keep reading until ".", even if spooling failed
+      spool_ok = spool_ok && spool.AddLine(request);
       continue;
     }
 
     // Extract command, for now assume no preceeding white spaces
-    const auto command = ExtractCommand(request);
-    LOG_F(INFO, "[%d] cmd={%s}", fd, command.c_str());
+    const auto verb = ExtractVerb(request);
+    LOG_F(INFO, "[%d] cmd={%.4s}", fd, request.c_str());
 
     // Check command
-    if (command == "HELO") {
-      // ===== HELO =====
+    switch (verb) {
+    case Verb("HELO"):
+    case Verb("EHLO"): {
+      // ===== HELO/EHLO =====
       // State has to be Wait
       if (fsm.state() != State::Wait) {
-        ReplyCode(fd, 503);
+        ReplyCode(conn, 503);
         continue;
       }
 
       // Try match "HELO <domain>"
       const auto domain = ExtractArgument(request);
       if (domain.empty()) {
-        LOG_F(WARNING, "[%d] Match HELO failed", fd);
-        ReplyCode(fd, 501);
+        LOG_F(WARNING, "[%d] Match %.4s failed", fd, request.c_str());
+        ReplyCode(conn, 501);
         continue;
       }
 
-      LOG_F(INFO, "[%d] Valid HELO, domain={%s}", fd, domain.c_str());
+      LOG_F(INFO, "[%d] Valid %.4s, domain={%s}", fd, request.c_str(),
+            domain.c_str());
 
-      fsm.execute(Trigger::HELO);
+      // EHLO also advertises extensions
+      fsm.execute(verb == Verb("EHLO") ? Trigger::EHLO : Trigger::HELO, act);
 
       const auto msg = "State transition: Wait -- HELO/ok --> Wait";
       CHECK_F(fsm.state() == State::Wait);
       LOG_F(INFO, "[%d] %s", fd, msg);
-
-    } else if (command == "MAIL") {
+      break;
+    }
+    case Verb("MAIL"): {
       // ===== MAIL =====
 
       // State has to be Wait
       if (fsm.state() != State::Wait) {
-        ReplyCode(fd, 503);
+        ReplyCode(conn, 503);
         continue;
       }
 
-      // Try match "MAIL FROM:<some.guy@somewhere>"
-      std::smatch results;
-      if (!std::regex_search(request, results, mailfrom_regex_)) {
+      // Try match "MAIL FROM:<some.guy@somewhere>", "<>" is for bounces
+      std::string mailaddr;
+      if (!ParsePath(request, "MAIL FROM:", mailaddr, true)) {
         LOG_F(WARNING, "[%d] Match MAIL FROM failed", fd);
-        ReplyCode(fd, 501);
+        ReplyCode(conn, 501);
         continue;
       }
 
-      const auto &mailaddr = results.str(1);
       LOG_F(INFO, "[%d] Valid MAIL FROM, mailaddr={%s}", fd, mailaddr.c_str());
 
       mail.set_sender(mailaddr);
-      fsm.execute(Trigger::MAIL);
+      fsm.execute(Trigger::MAIL, act);
 
       const auto msg = "State transition: Wait -- MAIL/ok --> Mail";
       CHECK_F(fsm.state() == State::Mail);
       LOG_F(INFO, "[%d] %s", fd, msg);
-
-    } else if (command == "RCPT") {
+      break;
+    }
+    case Verb("RCPT"): {
       // ===== RCPT =====
 
       // State has to be Mail or Rcpt
       if (!(fsm.state() == State::Mail || fsm.state() == State::Rcpt)) {
-        ReplyCode(fd, 503);
+        ReplyCode(conn, 503);
         continue;
       }
 
       // Try match "RCPT TO:<some.guy@somewhere>"
-      std::smatch results;
-      if (!std::regex_search(request, results, rcptto_regex_)) {
+      std::string mailaddr;
+      if (!ParsePath(request, "RCPT TO:", mailaddr)) {
         LOG_F(WARNING, "[%d] Match RCPT TO failed", fd);
-        ReplyCode(fd, 501);
+        ReplyCode(conn, 501);
         continue;
       }
 
-      const auto &mailaddr = results.str(1);
       LOG_F(INFO, "[%d] Valid RCPT TO, mailaddr={%s}", fd, mailaddr.c_str());
 
       // Check if user exists
       if (!UserExistsByMailaddr(mailaddr)) {
         LOG_F(WARNING, "[%d] User doesn't exist, mailaddr={%s}", fd,
               mailaddr.c_str());
-        WriteLine(fd, "550 No such user");
+        conn.WriteLine("550 No such user");
         continue;
       }
 
@@ -193,7 +293,7 @@ void SmtpServer::Work(SocketPtr sock_ptr) {
               mailaddr.c_str());
       }
 
-      fsm.execute(Trigger::RCPT);
+      fsm.execute(Trigger::RCPT, act);
 
       LOG_F(INFO, "[%d] Number of recipients, n={%zu}", fd,
             mail.recipients().size());
@@ -201,70 +301,93 @@ void SmtpServer::Work(SocketPtr sock_ptr) {
       const auto msg = "State transition: Mail/Rcpt -- RCPT/ok --> Rcpt";
       CHECK_F(fsm.state() == State::Rcpt);
       LOG_F(INFO, "[%d] %s", fd, msg);
-
-    } else if (command == "RSET") {
+      break;
+    }
+    case Verb("RSET"): {
       // ===== RSET =====
       if (!(fsm.state() == State::Mail || fsm.state() == State::Rcpt ||
             fsm.state() == State::Wait)) {
-        ReplyCode(fd, 503);
+        ReplyCode(conn, 503);
         continue;
       }
 
-      fsm.execute(Trigger::RSET);
+      fsm.execute(Trigger::RSET, act);
 
       const auto msg = "State transition: Mail/Rcpt -- RSET/reset --> Wait";
       CHECK_F(fsm.state() == State::Wait);
       CHECK_F(mail.Empty());
       LOG_F(INFO, "[%d] %s", fd, msg);
-    } else if (command == "NOOP") {
+      break;
+    }
+    case Verb("NOOP"):
       // ===== NOOP =====
       LOG_F(INFO, "[%d] NOOP", fd);
-      WriteLine(fd, "250 OK");
-    } else if (command == "DATA") {
+      conn.WriteLine("250 OK");
+      break;
+    case Verb("DATA"): {
       // ===== DATA =====
       if (fsm.state() != State::Rcpt) {
-        ReplyCode(fd, 503);
+        ReplyCode(conn, 503);
+        continue;
+      }
+
+      if (!spool.Open()) {
+        conn.WriteLine("451 Requested action aborted: local error in "
+                       "processing");
         continue;
       }
 
-      fsm.execute(Trigger::DATA);
+      fsm.execute(Trigger::DATA, act);
 
       const auto msg = "State transition: Rcpt -- Data/ok_data --> Data";
       CHECK_F(fsm.state() == State::Data);
       LOG_F(INFO, "[%d] %s", fd, msg);
-    } else if (command == "QUIT") {
-      WriteLine(fd, "221 localhost Service closing");
-
-      // Close socket and mark it as closed
-      close(fd);
-      LOG_F(INFO, "[%d] Connection closed", fd);
-      if (verbose_)
-        fprintf(stderr, "[%d] Connection closed\n", fd);
-
-      // Set socket fd to -1
-      std::lock_guard<std::mutex> guard(sockets_mutex_);
-      *sock_ptr = -1;
-      return;
-    } else {
-      WriteLine(fd, "500 Syntax error, command unrecognized");
+      break;
+    }
+    case Verb("QUIT"):
+      conn.WriteLine("221 localhost Service closing");
+      conn.Flush();
+      quit = true;
+      break;
+    default:
+      conn.WriteLine("500 Syntax error, command unrecognized");
     }
   }
+
+  // Close socket and mark it as closed
+  close(fd);
+  LOG_F(INFO, "[%d] Connection closed", fd);
+  if (verbose_)
+    fprintf(stderr, "[%d] Connection closed\n", fd);
+
+  // Set socket fd to -1
+  std::lock_guard<std::mutex> guard(sockets_mutex_);
+  *sock_ptr = -1;
 }
 
-void SmtpServer::SendMail(const Mail &mail, int fd) const {
-  for (const auto &recipient : mail.recipients()) {
-    auto user = GetUserByMailaddr(recipient);
+bool SmtpServer::Deliver(const Mail &mail, const Spool &spool,
+                         const std::string &recipient) {
+  auto user = GetUserByMailaddr(recipient);
 
-    // This should never happen, because we checked this in Rcpt state
-    if (!user) {
-      LOG_F(ERROR, "[%d] Could not find recipient, mailaddr={%s}", fd,
-            recipient.c_str());
-      continue;
-    }
+  // Checked in Rcpt state, but the user may be gone by now
+  if (!user) {
+    LOG_F(ERROR, "Could not find recipient, mailaddr={%s}", recipient.c_str());
+    return false;
+  }
+
+  if (!user->Deliver(mail, spool, &group_commit_)) {
+    LOG_F(ERROR, "Failed to deliver, mailaddr={%s}", recipient.c_str());
+    return false;
+  }
+  LOG_F(INFO, "Finish sending to recipient, mailaddr={%s}", recipient.c_str());
+  return true;
+}
 
-    std::lock_guard<std::mutex> guard(*(user->mutex()));
-    user->WriteMail(mail);
-    LOG_F(INFO, "[%d] Finish sending to recipient, mailaddr={%s}", fd,
-          recipient.c_str());
+bool SmtpServer::SendMail(const Mail &mail, Spool &spool, int fd) {
+  // Acknowledged once it is safely in the queue, delivery happens later
+  if (!queue_.Enqueue(mail, spool)) {
+    LOG_F(ERROR, "[%d] Failed to queue mail", fd);
+    return false;
   }
+  return true;
 }
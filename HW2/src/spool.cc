@@ -0,0 +1,151 @@
+#include "spool.h"
+#include "fileio.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <vector>
+
+namespace {
+constexpr size_t kBufferSize = 64 * 1024;
+}
+
+Spool::Spool(const std::string &dir) : dir_(dir) {}
+
+Spool::~Spool() {
+  if (fd_ < 0)
+    return;
+
+  close(fd_);
+  if (!owned_)
+    return;
+  unlink(path_.c_str());
+  LOG_F(INFO, "Remove spool, path={%s}", path_.c_str());
+}
+
+bool Spool::Open() {
+  if (fd_ >= 0)
+    return true;
+
+  std::string path = dir_ + "/spool.XXXXXX";
+  std::vector<char> templ(path.begin(), path.end());
+  templ.push_back('\0');
+
+  fd_ = mkstemp(templ.data());
+  if (fd_ < 0) {
+    LOG_F(ERROR, "Failed to create spool, dir={%s}", dir_.c_str());
+    return false;
+  }
+
+  path_ = templ.data();
+  buffer_.reserve(kBufferSize);
+  LOG_F(INFO, "Create spool, path={%s}", path_.c_str());
+  return true;
+}
+
+bool Spool::AddLine(const std::string &line) {
+  if (buffer_.size() + line.size() + 2 > kBufferSize && !Flush())
+    return false;
+
+  // A single huge line goes straight to the file
+  if (line.size() + 2 > kBufferSize) {
+    if (!WriteAll(fd_, line.data(), line.size()) || !WriteAll(fd_, "\r\n", 2))
+      return false;
+  } else {
+    buffer_ += line;
+    buffer_ += "\r\n";
+  }
+
+  size_ += line.size() + 2;
+  ++num_lines_;
+  hasher_.Update(line);
+  return true;
+}
+
+bool Spool::Finish() {
+  uid_ = hasher_.Final();
+  return Flush();
+}
+
+bool Spool::Flush() {
+  if (buffer_.empty())
+    return true;
+
+  const bool ok = WriteAll(fd_, buffer_.data(), buffer_.size());
+  if (!ok)
+    LOG_F(ERROR, "Failed to write spool, path={%s}", path_.c_str());
+  buffer_.clear();
+  return ok;
+}
+
+bool Spool::Commit(const std::string &path) {
+  if (fd_ < 0)
+    return false;
+
+  if (fsync(fd_) == -1 || std::rename(path_.c_str(), path.c_str()) == -1) {
+    LOG_F(ERROR, "Failed to commit spool, path={%s}", path_.c_str());
+    return false;
+  }
+
+  LOG_F(INFO, "Commit spool, path={%s}, to={%s}", path_.c_str(), path.c_str());
+  mapped_.reset();
+  close(fd_);
+  fd_ = -1;
+  path_.clear();
+  return true;
+}
+
+bool Spool::Load(const std::string &path, size_t size, size_t num_lines,
+                 const std::string &uid) {
+  if (FileSize(path) != size) {
+    LOG_F(ERROR, "Spool has wrong size, path={%s}", path.c_str());
+    return false;
+  }
+
+  fd_ = open(path.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    LOG_F(ERROR, "Failed to open spool, path={%s}", path.c_str());
+    return false;
+  }
+
+  path_ = path;
+  owned_ = false;
+  size_ = size;
+  num_lines_ = num_lines;
+  uid_ = uid;
+  return true;
+}
+
+bool Spool::Map() {
+  if (mapped_)
+    return true;
+
+  std::unique_ptr<MappedFile> mapped(new MappedFile(path_));
+  if (!mapped->ok() || mapped->size() != size_) {
+    LOG_F(WARNING, "Failed to map spool, path={%s}", path_.c_str());
+    return false;
+  }
+  mapped_ = std::move(mapped);
+  return true;
+}
+
+void Spool::Clear() {
+  // Unmap before truncating, touching a mapping past the end of file faults
+  mapped_.reset();
+  buffer_.clear();
+  size_ = 0;
+  num_lines_ = 0;
+  hasher_ = UidHasher();
+  uid_.clear();
+  if (fd_ >= 0 && (ftruncate(fd_, 0) == -1 || lseek(fd_, 0, SEEK_SET) == -1))
+    LOG_F(WARNING, "Failed to clear spool, path={%s}", path_.c_str());
+}
+
+bool Spool::CopyTo(int out_fd) const {
+  if (mapped_)
+    return WriteAll(out_fd, mapped_->data(), mapped_->size());
+  return CopyRange(fd_, 0, size_, out_fd);
+}
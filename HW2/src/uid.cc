@@ -0,0 +1,152 @@
+#include "uid.h"
+
+#include <string.h>
+
+/**
+ * @brief Convert hash to c++ string
+ * @param hash an array of unsigned char
+ * @param len length of hash
+ * @return string representation in hex
+ */
+std::string StringFromHash(const unsigned char *hash, size_t len) {
+  static const char *hex_digits = "0123456789ABCDEF";
+  std::string str;
+  str.reserve(len * 2);
+  for (size_t i = 0; i != len; ++i) {
+    str += hex_digits[hash[i] / 16];
+    str += hex_digits[hash[i] % 16];
+  }
+  return str;
+}
+
+#ifdef UID_XXH64
+
+namespace {
+// XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// Little endian loads, memcpy keeps them safe for unaligned input
+inline uint64_t Read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t Read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t Round(uint64_t acc, uint64_t input) {
+  acc += input * kPrime2;
+  acc = Rotl(acc, 31);
+  return acc * kPrime1;
+}
+
+inline uint64_t MergeRound(uint64_t acc, uint64_t val) {
+  acc ^= Round(0, val);
+  return acc * kPrime1 + kPrime4;
+}
+} // namespace
+
+UidHasher::UidHasher() {
+  acc_[0] = kPrime1 + kPrime2;
+  acc_[1] = kPrime2;
+  acc_[2] = 0;
+  acc_[3] = 0 - kPrime1;
+}
+
+void UidHasher::Update(const char *data, size_t len) {
+  auto p = reinterpret_cast<const unsigned char *>(data);
+  const auto end = p + len;
+  total_len_ += len;
+
+  // Not enough for a stripe yet, just keep it
+  if (buf_len_ + len < sizeof(buf_)) {
+    memcpy(buf_ + buf_len_, p, len);
+    buf_len_ += len;
+    return;
+  }
+
+  // Complete the pending stripe first
+  if (buf_len_ > 0) {
+    const size_t n = sizeof(buf_) - buf_len_;
+    memcpy(buf_ + buf_len_, p, n);
+    p += n;
+    for (int i = 0; i < 4; ++i)
+      acc_[i] = Round(acc_[i], Read64(buf_ + i * 8));
+    buf_len_ = 0;
+  }
+
+  for (; p + sizeof(buf_) <= end; p += sizeof(buf_)) {
+    for (int i = 0; i < 4; ++i)
+      acc_[i] = Round(acc_[i], Read64(p + i * 8));
+  }
+
+  buf_len_ = end - p;
+  memcpy(buf_, p, buf_len_);
+}
+
+std::string UidHasher::Final() {
+  uint64_t h;
+  if (total_len_ >= sizeof(buf_)) {
+    h = Rotl(acc_[0], 1) + Rotl(acc_[1], 7) + Rotl(acc_[2], 12) +
+        Rotl(acc_[3], 18);
+    for (int i = 0; i < 4; ++i)
+      h = MergeRound(h, acc_[i]);
+  } else {
+    h = acc_[2] + kPrime5; // seed + prime5
+  }
+  h += total_len_;
+
+  const unsigned char *p = buf_;
+  const unsigned char *end = buf_ + buf_len_;
+  for (; p + 8 <= end; p += 8) {
+    h ^= Round(0, Read64(p));
+    h = Rotl(h, 27) * kPrime1 + kPrime4;
+  }
+  if (p + 4 <= end) {
+    h ^= static_cast<uint64_t>(Read32(p)) * kPrime1;
+    h = Rotl(h, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= *p * kPrime5;
+    h = Rotl(h, 11) * kPrime1;
+  }
+
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+
+  // Big endian, so the id reads as the canonical hex of the hash
+  unsigned char hash[8];
+  for (int i = 0; i < 8; ++i)
+    hash[i] = static_cast<unsigned char>(h >> (56 - i * 8));
+  return StringFromHash(hash, sizeof(hash));
+}
+
+#else
+
+UidHasher::UidHasher() { MD5_Init(&ctx_); }
+
+void UidHasher::Update(const char *data, size_t len) {
+  MD5_Update(&ctx_, data, len);
+}
+
+std::string UidHasher::Final() {
+  unsigned char hash[MD5_DIGEST_LENGTH];
+  MD5_Final(hash, &ctx_);
+  return StringFromHash(hash, MD5_DIGEST_LENGTH);
+}
+
+#endif
@@ -1,69 +1,559 @@
 #include "user.h"
-#include "loguru.hpp"
+#include "fileio.h"
+#include "groupcommit.h"
+#include "log.h"
+#include "spool.h"
+#include "uid.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
-#include <iostream>
-#include <regex>
+#include <set>
+#include <vector>
+
+namespace {
+constexpr size_t kReadChunk = 4096; // for reading part of a mail
+
+/**
+ * @brief The MailHead struct, parts of the first line of a mail
+ */
+struct MailHead {
+  const char *sender = nullptr;
+  const char *sender_end = nullptr;
+  const char *time = nullptr;
+  const char *time_end = nullptr;
+};
+
+inline bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' ||
+         c == '\f';
+}
+
+inline bool IsTimeChar(char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+         (c >= 'A' && c <= 'Z') || c == ':' || IsSpace(c);
+}
+
+/**
+ * @brief Parse the first line of a mail, "From <sender> date", without LF.
+ * Sender is whatever SMTP accepted, and may be empty for bounces
+ * @return False if line is not the first line of a mail
+ */
+bool ParseMailHead(const char *begin, const char *end, MailHead &head) {
+  static const char prefix[] = "From <";
+  constexpr size_t prefix_len = sizeof(prefix) - 1;
+  if (static_cast<size_t>(end - begin) < prefix_len ||
+      memcmp(begin, prefix, prefix_len) != 0)
+    return false;
+
+  const char *p = begin + prefix_len;
+  head.sender = p;
+  while (p != end && *p != '>' && *p != '<' && !IsSpace(*p))
+    ++p;
+  head.sender_end = p;
+
+  // "> " and at least one char of date
+  if (end - p < 3 || p[0] != '>' || p[1] != ' ' || !IsTimeChar(p[2]))
+    return false;
+
+  p += 2;
+  head.time = p;
+  while (p != end && IsTimeChar(*p))
+    ++p;
+  head.time_end = p;
+  return true;
+}
+
+/**
+ * @brief First line of a mail in the mbox, ends with CRLF like the content
+ */
+std::string HeadLine(const Mail &mail) {
+  // TimeStr() already ends with a newline
+  auto time = mail.TimeStr();
+  if (!time.empty() && time.back() == '\n')
+    time.pop_back();
+  return "From <" + mail.sender() + "> " + time + "\r\n";
+}
+
+/**
+ * @brief End of a line without its CR, if the mail is stored with CRLF
+ */
+inline const char *StripCr(const char *begin, const char *end, bool crlf) {
+  return crlf && end != begin && end[-1] == '\r' ? end - 1 : end;
+}
+
+} // namespace
 
 User::User(const std::string &mailbox, const std::string &username)
     : mailbox_(mailbox), username_(username), password_("cis505"),
-      mailaddr_(username + "@localhost"),
+      mailaddr_(username + "@localhost"), index_(mailbox + ".idx"),
       mutex_(std::make_shared<std::mutex>()) {}
 
+FileFdPtr User::LockMailbox() const {
+  for (;;) {
+    auto file = FdCache::Global().Get(mailbox_, true);
+    if (!file) {
+      LOG_F(ERROR, "Failed to open mailbox, path={%s}", mailbox_.c_str());
+      return nullptr;
+    }
+
+    if (flock(file->fd(), LOCK_EX) == -1) {
+      LOG_F(ERROR, "Failed to lock mailbox, path={%s}", mailbox_.c_str());
+      return nullptr;
+    }
+
+    if (IsSameFile(file->fd(), mailbox_))
+      return file;
+
+    // Replaced by a compaction, maybe in another process, open it again
+    flock(file->fd(), LOCK_UN);
+    FdCache::Global().Evict(mailbox_);
+  }
+}
+
+bool User::AppendMail(IndexEntry &entry, const std::string &head,
+                      const char *data, size_t len, const Spool *spool) const {
+  const auto file = LockMailbox();
+  if (!file)
+    return false;
+
+  const int fd = file->fd();
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    LOG_F(ERROR, "Failed to stat mailbox, path={%s}", mailbox_.c_str());
+    flock(fd, LOCK_UN);
+    return false;
+  }
+  entry.offset = st.st_size;
+  entry.body = entry.offset + head.size();
+  entry.end = entry.body + (spool ? spool->size() : len);
+
+  // An index started by this append would not cover the mails before it,
+  // Load rejects such an index and every login would scan the whole mbox
+  bool indexed = entry.offset == 0 || index_.Exists();
+  if (!indexed) {
+    LOG_F(INFO, "Build index before append, path={%s}", index_.path().c_str());
+    const auto entries = ScanMailbox(0);
+    const size_t end = entries.empty() ? 0 : entries.back().end;
+    indexed = end == entry.offset && index_.Save(entries);
+    if (!indexed)
+      LOG_F(WARNING, "Failed to build index, path={%s}", index_.path().c_str());
+  }
+
+  bool ok = WriteAll(fd, head.data(), head.size()) &&
+            (spool ? spool->CopyTo(fd) : WriteAll(fd, data, len));
+  if (!ok) {
+    LOG_F(ERROR, "Failed to write mailbox, path={%s}", mailbox_.c_str());
+  } else if (indexed && !index_.Append(entry)) {
+    LOG_F(ERROR, "Failed to append to index, path={%s}",
+          index_.path().c_str());
+    ok = false;
+  }
+
+  // Take back what was written, so a retry doesn't store the mail twice
+  if (!ok && ftruncate(fd, entry.offset) == -1)
+    LOG_F(ERROR, "Failed to truncate mailbox, path={%s}", mailbox_.c_str());
+
+  flock(fd, LOCK_UN);
+  return ok;
+}
+
 void User::WriteMail(const Mail &mail) const {
-  std::ofstream mbox_file;
-  mbox_file.open(mailbox_, std::ios::out | std::ios::app);
-  mbox_file << "From <" << mail.sender() << "> " << mail.TimeStr();
-  for (const auto &line : mail.lines()) {
-    mbox_file << line << "\n";
+  IndexEntry entry;
+  entry.crlf = true; // content is already in wire form
+  entry.octets = mail.Octets();
+
+  UidHasher hasher;
+  for (size_t i = 0; i < mail.NumLines(); ++i) {
+    hasher.Update(mail.LineData(i), mail.LineSize(i));
   }
-  mbox_file.close();
+  entry.uid = hasher.Final();
+
+  const auto &body = mail.body();
+  AppendMail(entry, HeadLine(mail), body.data(), body.size(), nullptr);
+}
+
+bool User::WriteMail(const Mail &mail, const Spool &spool) const {
+  IndexEntry entry;
+  entry.crlf = true; // spool is in wire form
+  entry.octets = spool.octets();
+  entry.uid = spool.uid();
+  return AppendMail(entry, HeadLine(mail), nullptr, 0, &spool);
+}
+
+bool User::Deliver(const Mail &mail, const Spool &spool,
+                   GroupCommit *commit) const {
+  {
+    std::lock_guard<std::mutex> guard(delivery_mutex_);
+    if (!WriteMail(mail, spool))
+      return false;
+  }
+
+  // Wait for the sync without the lock, so that more mails can be appended
+  // and synced together
+  if (commit == nullptr)
+    return true;
+  return commit->Sync(mailbox_, spool.size()).get();
+}
+
+std::vector<IndexEntry> User::LoadIndex() const {
+  const size_t mbox_size = FileSize(mailbox_);
+  std::vector<IndexEntry> entries;
+  const bool loaded = index_.Load(entries);
+  const size_t end = entries.empty() ? 0 : entries.back().end;
+
+  if (loaded && end == mbox_size)
+    return entries;
+
+  if (loaded && end < mbox_size) {
+    // Something was appended without updating the index, only scan that
+    LOG_F(INFO, "Update index, path={%s}, from={%zu}", index_.path().c_str(),
+          end);
+    const auto tail = ScanMailbox(end);
+    entries.insert(entries.end(), tail.begin(), tail.end());
+  } else {
+    LOG_F(INFO, "Rebuild index, path={%s}", index_.path().c_str());
+    entries = ScanMailbox(0);
+  }
+
+  index_.Save(entries);
+  return entries;
 }
 
 Maildrop User::ReadMaildrop() const {
+  std::vector<IndexEntry> entries;
+  {
+    std::lock_guard<std::mutex> guard(delivery_mutex_);
+    entries = LoadIndex();
+  }
+
+  // Mails are read through the cached fd, make sure it is not a file that
+  // was replaced since
+  const auto file = FdCache::Global().Get(mailbox_);
+  if (file && !IsSameFile(file->fd(), mailbox_))
+    FdCache::Global().Evict(mailbox_);
+
+  // Only the index is read here, content is loaded on demand by ReadMail
   Maildrop maildrop;
+  for (const auto &entry : entries) {
+    if (!entry.deleted)
+      maildrop.AddEntry(entry);
+  }
+  return maildrop;
+}
 
-  std::string mailaddr_pattern("[[:alnum:]]+[[:alnum:].]*");
-  mailaddr_pattern = mailaddr_pattern + "@" + mailaddr_pattern;
-  std::string datetime_pattern("[[:alnum:][:space:]\\:]+");
+Mail User::ReadMail(const IndexEntry &entry) const {
+  Mail mail;
+  mail.set_entry(entry);
+  mail.AddRecipient(mailaddr());
 
-  std::string mail_head_pattern =
-      "From <(" + mailaddr_pattern + ")> (" + datetime_pattern + ")";
-  std::regex mail_head_regex(mail_head_pattern);
+  // Head line and content in one read
+  std::string data(entry.end - entry.offset, '\0');
+  const auto file = FdCache::Global().Get(mailbox_);
+  const bool ok = file && pread(file->fd(), &data[0], data.size(),
+                                entry.offset) ==
+                              static_cast<ssize_t>(data.size());
+  if (!ok) {
+    LOG_F(ERROR, "Failed to read mail, path={%s}, offset={%zu}",
+          mailbox_.c_str(), entry.offset);
+    return mail;
+  }
 
-  std::string line;
-  std::ifstream mbox_file(mailbox_);
+  const char *p = data.data();
+  const char *end = p + data.size();
+  const char *body = p + (entry.body - entry.offset);
+
+  // The head line, if there is one
+  MailHead head;
+  if (body > p && ParseMailHead(p, StripCr(p, body - 1, entry.crlf), head)) {
+    mail.set_sender(std::string(head.sender, head.sender_end));
+    mail.SetTimeFromString(std::string(head.time, head.time_end));
+  }
+
+  // Content is copied once, into the body of the mail
+  mail.Reserve(entry.octets, entry.crlf ? 0 : entry.octets - (end - body));
+  for (p = body; p < end;) {
+    const char *lf = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (lf == nullptr)
+      lf = end;
+    mail.AddLine(p, StripCr(p, lf, entry.crlf) - p);
+    p = lf + 1;
+  }
+  return mail;
+}
+
+Mail User::ReadTop(const IndexEntry &entry, size_t num_lines) const {
   Mail mail;
-  while (std::getline(mbox_file, line)) {
-    if (line.substr(0, 5) == "From ") {
-      // Got the first line
-      std::smatch results;
-      if (std::regex_search(line, results, mail_head_regex)) {
-        // This is a new mail
-        // Add old mail first
-        if (!mail.Empty())
-          maildrop.AddMail(mail);
-        // Prepare for new mail
-        mail.Clear();
-        mail.set_sender(results.str(1));
-        mail.SetTimeFromString(results.str(2));
-        mail.AddRecipient(mailaddr()); // This user is the recipient
+  mail.set_entry(entry);
+  mail.AddRecipient(mailaddr());
+
+  const auto file = FdCache::Global().Get(mailbox_);
+  if (!file) {
+    LOG_F(ERROR, "Failed to open mailbox, path={%s}", mailbox_.c_str());
+    return mail;
+  }
+
+  ReadTopRange(file->fd(), entry.body, entry.end, entry.crlf, num_lines, mail);
+  return mail;
+}
+
+void User::ReadTopRange(int fd, size_t begin, size_t end, bool crlf,
+                        size_t num_lines, Mail &mail) {
+  std::string data; // read but not split into lines yet
+  size_t pos = begin;
+  bool in_body = false;
+  size_t body_lines = 0;
+  char chunk[kReadChunk];
+
+  for (;;) {
+    // Take every complete line, the last line of the mail may have no LF
+    size_t start = 0;
+    while (start < data.size()) {
+      size_t lf = data.find('\n', start);
+      if (lf == std::string::npos) {
+        if (pos < end)
+          break;
+        lf = data.size();
+      }
+
+      if (in_body && body_lines == num_lines)
+        return;
+
+      const char *p = data.data() + start;
+      const size_t len = StripCr(p, data.data() + lf, crlf) - p;
+      mail.AddLine(p, len);
+      if (in_body)
+        ++body_lines;
+      else if (len == 0)
+        in_body = true; // empty line ends the header
+
+      start = lf + 1;
+    }
+    data.erase(0, std::min(start, data.size()));
+
+    if (pos >= end)
+      return;
+
+    const auto n = pread(fd, chunk, std::min(sizeof(chunk), end - pos), pos);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR)
         continue;
+      LOG_F(ERROR, "Failed to read mail, offset={%zu}", pos);
+      return;
+    }
+    data.append(chunk, n);
+    pos += n;
+  }
+}
+
+std::vector<IndexEntry> User::ScanMailbox(size_t from) const {
+  std::vector<IndexEntry> entries;
+
+  MappedFile mbox_file(mailbox_);
+  if (!mbox_file.ok()) {
+    LOG_F(ERROR, "Failed to map mailbox, path={%s}", mailbox_.c_str());
+    return entries;
+  }
+
+  const char *data = mbox_file.data();
+  const char *end = data + mbox_file.size();
+  IndexEntry entry;
+  UidHasher hasher;
+  bool in_mail = false;
+  MailHead head;
+  for (const char *p = data + std::min(from, mbox_file.size()); p < end;) {
+    const char *lf = static_cast<const char *>(memchr(p, '\n', end - p));
+    const char *line_end = lf == nullptr ? end : lf;
+    const char *next = lf == nullptr ? end : lf + 1;
+    const size_t offset = p - data;
+
+    // A head line ending with CRLF starts a mail stored in wire form
+    const bool crlf = line_end != p && line_end[-1] == '\r';
+    if (ParseMailHead(p, StripCr(p, line_end, crlf), head)) {
+      // This is a new mail
+      // Add old mail first
+      if (in_mail) {
+        entry.end = offset;
+        entry.uid = hasher.Final();
+        entries.push_back(entry);
       }
+      // Prepare for new mail
+      entry = IndexEntry();
+      entry.offset = offset;
+      entry.body = next - data;
+      entry.crlf = crlf;
+      hasher = UidHasher();
+      in_mail = true;
+      p = next;
+      continue;
     }
 
     // Everthing else is a line of the mail
-    mail.AddLine(line);
+    if (!in_mail) {
+      // Content before the first head line
+      entry = IndexEntry();
+      entry.offset = entry.body = offset;
+      in_mail = true;
+    }
+    const char *content_end = StripCr(p, line_end, entry.crlf);
+    entry.octets += (content_end - p) + 2;
+    hasher.Update(p, content_end - p);
+    p = next;
   }
 
-  if (!mail.Empty()) {
-    maildrop.AddMail(mail);
+  if (in_mail) {
+    entry.end = end - data;
+    entry.uid = hasher.Final();
+    entries.push_back(entry);
   }
-  return maildrop;
+  return entries;
+}
+
+SendStatus User::SendMail(const IndexEntry &entry, int out_fd) const {
+  if (!entry.crlf)
+    return SendStatus::NotSupported;
+
+  const auto file = FdCache::Global().Get(mailbox_);
+  if (!file) {
+    LOG_F(ERROR, "Failed to open mailbox, path={%s}", mailbox_.c_str());
+    return SendStatus::Failed;
+  }
+
+  if (!SendRange(file->fd(), entry.body, entry.end - entry.body, out_fd))
+    return SendStatus::Failed;
+  return SendStatus::Sent;
+}
+
+bool User::CommitMaildrop(const Maildrop &maildrop, bool &compact) const {
+  compact = false;
+  std::set<size_t> deleted;
+  for (size_t i = 0; i < maildrop.NumMails(true); ++i) {
+    if (maildrop.IsDeleted(i))
+      deleted.insert(maildrop.GetEntry(i).offset);
+  }
+
+  // Nothing changed, nothing to write
+  if (deleted.empty())
+    return true;
+
+  // Mark deleted mails in the index only, the mbox is left as it is
+  std::lock_guard<std::mutex> guard(delivery_mutex_);
+  auto entries = LoadIndex();
+  size_t dead = 0;
+  for (auto &entry : entries) {
+    if (deleted.count(entry.offset))
+      entry.deleted = true;
+    if (entry.deleted)
+      dead += entry.end - entry.offset;
+  }
+  if (!index_.Save(entries)) {
+    LOG_F(ERROR, "Failed to commit maildrop, user={%s}", username_.c_str());
+    return false;
+  }
+  LOG_F(INFO, "Commit maildrop, user={%s}, deleted={%zu}", username_.c_str(),
+        deleted.size());
+
+  // Worth compacting once at least half of the mbox is deleted mails
+  const size_t total = entries.empty() ? 0 : entries.back().end;
+  compact = dead > 0 && dead * 2 >= total;
+  return true;
+}
+
+void User::Compact() const {
+  std::vector<IndexEntry> entries;
+  {
+    std::lock_guard<std::mutex> guard(delivery_mutex_);
+    entries = LoadIndex();
+  }
+  const bool any_deleted =
+      std::any_of(entries.begin(), entries.end(),
+                  [](const IndexEntry &entry) { return entry.deleted; });
+  if (!any_deleted)
+    return;
+
+  const int in_fd = open(mailbox_.c_str(), O_RDONLY);
+  if (in_fd < 0) {
+    LOG_F(ERROR, "Failed to open mailbox, path={%s}", mailbox_.c_str());
+    return;
+  }
+
+  // Copy the remaining mails to a new file and swap it in with rename, so
+  // the mbox is always either the old or the new one
+  const auto tmp_path = mailbox_ + ".tmp";
+  const int out_fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0) {
+    LOG_F(ERROR, "Failed to open mailbox, path={%s}", tmp_path.c_str());
+    close(in_fd);
+    return;
+  }
+
+  std::vector<IndexEntry> kept;
+  size_t offset = 0;
+  auto copy = [&](const IndexEntry &entry) {
+    const size_t len = entry.end - entry.offset;
+    if (!CopyRange(in_fd, entry.offset, len, out_fd))
+      return false;
+
+    IndexEntry moved = entry;
+    moved.offset = offset;
+    moved.body = offset + (entry.body - entry.offset);
+    moved.end = offset + len;
+    kept.push_back(moved);
+    offset += len;
+    return true;
+  };
+
+  // Bulk of the copy runs while deliveries go on
+  bool ok = true;
+  for (const auto &entry : entries) {
+    if (!entry.deleted && !(ok = copy(entry)))
+      break;
+  }
+
+  // Mails delivered meanwhile are copied with deliveries held off, then the
+  // new file is swapped in. The flock keeps out deliveries of other
+  // processes, they check the file is still the mbox once they get the lock
+  const size_t copied_end = entries.empty() ? 0 : entries.back().end;
+  std::lock_guard<std::mutex> guard(delivery_mutex_);
+  if (flock(in_fd, LOCK_EX) == -1)
+    ok = false;
+  for (const auto &entry : LoadIndex()) {
+    if (!ok)
+      break;
+    if (entry.offset >= copied_end && !entry.deleted)
+      ok = copy(entry);
+  }
+
+  ok = ok && fsync(out_fd) == 0;
+  close(out_fd);
+
+  if (!ok || std::rename(tmp_path.c_str(), mailbox_.c_str()) != 0) {
+    LOG_F(ERROR, "Failed to compact mailbox, path={%s}", mailbox_.c_str());
+    unlink(tmp_path.c_str());
+    close(in_fd);
+    return;
+  }
+
+  // Cached fd is the old file
+  FdCache::Global().Evict(mailbox_);
+  index_.Save(kept);
+  close(in_fd); // releases the flock
+  LOG_F(INFO, "Compact mailbox, path={%s}, n={%zu}, size={%zu}",
+        mailbox_.c_str(), kept.size(), offset);
 }
 
 void User::ClearMailbox() const {
+  std::lock_guard<std::mutex> guard(delivery_mutex_);
   std::ofstream mbox_file;
   mbox_file.open(mailbox_, std::ios::out | std::ios::trunc);
   mbox_file.close();
+  index_.Save({});
 }
@@ -0,0 +1,76 @@
+#include "smtpparser.h"
+
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+// Compare the hand written MAIL/RCPT parser with the regex it replaced
+
+using Clock = std::chrono::steady_clock;
+
+int main(int argc, char *argv[]) {
+  const int rounds = argc > 1 ? std::atoi(argv[1]) : 200000;
+
+  // The regex SmtpServer used before
+  std::string mailaddr_pattern("[[:alnum:]]+[[:alnum:].]*");
+  mailaddr_pattern = mailaddr_pattern + "@" + mailaddr_pattern;
+  std::string rcpt_to_pattern = "RCPT TO:[ ]*<(" + mailaddr_pattern + ")>";
+  std::regex rcpt_to_regex(rcpt_to_pattern, std::regex::icase);
+
+  const std::vector<std::string> requests = {
+      "RCPT TO:<linhphan@localhost>",
+      "rcpt to:   <benjamin.franklin@localhost>",
+      "RCPT TO:<some.guy@somewhere.far.away.com> NOTIFY=NEVER",
+      "RCPT TO:linhphan@localhost",
+      "RCPT TO:<@localhost>",
+  };
+
+  // Both agree on addresses the old pattern knew about
+  for (const auto &request : requests) {
+    std::smatch results;
+    std::string mailaddr;
+    const bool by_regex = std::regex_search(request, results, rcpt_to_regex);
+    const bool by_parser = ParsePath(request, "RCPT TO:", mailaddr);
+    assert(by_regex == by_parser);
+    assert(!by_parser || mailaddr == results.str(1));
+  }
+
+  // And the parser also takes what the old pattern rejected
+  std::string mailaddr;
+  assert(ParsePath("RCPT TO:<first-last+tag@sub-domain.org>", "RCPT TO:",
+                   mailaddr));
+  assert(mailaddr == "first-last+tag@sub-domain.org");
+  assert(!ParsePath("RCPT TO:<a..b@localhost>", "RCPT TO:", mailaddr));
+  assert(ParsePath("MAIL FROM:<>", "MAIL FROM:", mailaddr, true));
+
+  size_t matched = 0;
+  auto start = Clock::now();
+  for (int i = 0; i < rounds; ++i) {
+    for (const auto &request : requests) {
+      std::smatch results;
+      matched += std::regex_search(request, results, rcpt_to_regex);
+    }
+  }
+  const auto regex_time = Clock::now() - start;
+
+  start = Clock::now();
+  for (int i = 0; i < rounds; ++i) {
+    for (const auto &request : requests) {
+      matched += ParsePath(request, "RCPT TO:", mailaddr);
+    }
+  }
+  const auto parser_time = Clock::now() - start;
+
+  using std::chrono::duration_cast;
+  using std::chrono::nanoseconds;
+  const double n = static_cast<double>(rounds) * requests.size();
+  const double regex_ns = duration_cast<nanoseconds>(regex_time).count() / n;
+  const double parser_ns = duration_cast<nanoseconds>(parser_time).count() / n;
+  std::cout << "regex:  " << regex_ns << " ns/cmd" << std::endl;
+  std::cout << "parser: " << parser_ns << " ns/cmd" << std::endl;
+  std::cout << "speedup: " << regex_ns / parser_ns << "x (" << matched
+            << " matched)" << std::endl;
+}
@@ -0,0 +1,94 @@
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#define LOGURU_IMPLEMENTATION 1
+#include "loguru.hpp"
+
+constexpr int kPort = 10505;
+
+// Greets, then holds the connection until the client closes it
+class HoldServer : public Server {
+public:
+  using Server::Server;
+
+  void Work(SocketPtr sock_ptr) override {
+    const int fd = *sock_ptr;
+    WriteLine(fd, "+OK ready");
+    char ch;
+    while (read(fd, &ch, 1) > 0) {
+    }
+    CloseSocket(sock_ptr);
+  }
+};
+
+int Connect() {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(fd >= 0);
+
+  // A connection left waiting for a worker never gets its greeting
+  timeval timeout{2, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(kPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const int ret = connect(fd, (sockaddr *)&addr, sizeof(addr));
+  assert(ret == 0);
+  (void)ret;
+  return fd;
+}
+
+std::string ReadReply(int fd) {
+  std::string reply;
+  char ch;
+  while (read(fd, &ch, 1) == 1 && ch != '\n')
+    reply += ch;
+  return reply;
+}
+
+int main() {
+  loguru::g_stderr_verbosity = loguru::Verbosity_OFF;
+
+  // Two workers and no queue, split over two acceptors
+  HoldServer server(kPort, 10, false);
+  server.SetWorkers(2, 0);
+  server.SetAcceptors(2);
+  server.Setup();
+  std::thread([&server] { server.Run(); }).detach();
+
+  // The kernel picks the acceptor of each connection, both connections
+  // must be served whichever acceptors they land on, enough rounds make it
+  // land both on the same one
+  for (int round = 0; round < 20; ++round) {
+    const int first = Connect();
+    assert(ReadReply(first) == "+OK ready\r");
+    const int second = Connect();
+    assert(ReadReply(second) == "+OK ready\r");
+
+    // Every worker is busy, a third one is turned away
+    const int third = Connect();
+    assert(ReadReply(third) == "-ERR Server busy, try again later\r");
+
+    close(first);
+    close(second);
+    close(third);
+
+    // Let the workers give their slots back
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+
+  std::cout << "OK" << std::endl;
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include "tablefsm.h"
+#include <cassert>
+#include <iostream>
+
+enum class State { Init, Ready, Wait, Mail, Rcpt };
+enum class Trigger {
+  CONN, // On connection
+  HELO,
+  MAIL,
+  RCPT,
+  RSET,
+  NOOP,
+  QUIT,
+  DATA,
+};
+enum class Action { None, Greet, Ok };
+using MyFsm = TableFsm<State, State::Init, 5, Trigger, 8, Action>;
+
+// from, to, trigger, action
+constexpr MyFsm::Trans kTransitions[] = {
+    {State::Init, State::Ready, Trigger::CONN, Action::Greet},
+    {State::Ready, State::Wait, Trigger::HELO, Action::Ok},
+    {State::Wait, State::Mail, Trigger::MAIL, Action::Ok},
+    // Shadowed by the one above
+    {State::Wait, State::Rcpt, Trigger::MAIL, Action::None},
+};
+constexpr auto kTable = MyFsm::MakeTable(kTransitions);
+
+// The table is built by the compiler
+static_assert(kTable.entries[0].valid, "Init -- CONN --> Ready");
+static_assert(kTable.entries[0].to_state == State::Ready,
+              "Init -- CONN --> Ready");
+static_assert(!kTable.entries[1].valid, "Init has no HELO");
+
+int main() {
+  int greets = 0;
+  int oks = 0;
+  auto act = [&](Action action) {
+    switch (action) {
+    case Action::None:
+      break;
+    case Action::Greet:
+      std::cout << "Service Ready" << std::endl;
+      ++greets;
+      break;
+    case Action::Ok:
+      std::cout << "OK" << std::endl;
+      ++oks;
+      break;
+    }
+  };
+
+  MyFsm fsm(kTable);
+  assert(fsm.is_initial());
+
+  assert(fsm.execute(Trigger::CONN, act));
+  assert(fsm.state() == State::Ready);
+  assert(greets == 1);
+
+  assert(!fsm.execute(Trigger::MAIL, act));
+  assert(fsm.state() == State::Ready);
+  assert(oks == 0);
+
+  assert(fsm.execute(Trigger::HELO, act));
+  assert(fsm.state() == State::Wait);
+
+  assert(fsm.execute(Trigger::MAIL, act));
+  assert(fsm.state() == State::Mail);
+  assert(oks == 2);
+
+  fsm.reset();
+  assert(fsm.is_initial());
+}